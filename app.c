@@ -1,13 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <cam/app.h>
+#include <cam/utils.h>
 
 #if defined(DBG_APP)
 #define pr_debug(fmt, ...) \
@@ -25,9 +31,11 @@ struct app_event {
     void (*handler_rd)(int fd, void *arg);
     void (*handler_wr)(int fd, void *arg);
     void (*handler_er)(int fd, void *arg);
+    void (*handler_pr)(int fd, void *arg);
     void *arg_rd;
     void *arg_wr;
     void *arg_er;
+    void *arg_pr;
 };
 
 bool app_event_epolled(app_event_t ev)
@@ -47,11 +55,19 @@ app_event_t app_event_create(int fd)
     return e;
 }
 
-void app_event_add_notifier(app_event_t ev, enum app_notifier_t type, 
+/*
+ * type为NOTIFIER_READ等类型, 可与NOTIFIER_EDGE按位或,
+ * 此时事件以边沿触发(EPOLLET)方式注册, 处理函数需一直读写到EAGAIN
+ */
+void app_event_add_notifier(app_event_t ev, int type, 
                             void (*handler)(int, void *), void *arg)
 {
     struct app_event *e = ev; 
-    switch (type) {
+
+    if (type & NOTIFIER_EDGE)
+        e->events |= EPOLLET;
+
+    switch (type & ~NOTIFIER_EDGE) {
     case NOTIFIER_READ:
         e->events |= EPOLLIN;
         e->handler_rd = handler;
@@ -67,6 +83,11 @@ void app_event_add_notifier(app_event_t ev, enum app_notifier_t type,
         e->handler_er = handler;
         e->arg_er = arg;
         break;
+    case NOTIFIER_PRI:
+        e->events |= EPOLLPRI;
+        e->handler_pr = handler;
+        e->arg_pr = arg;
+        break;
     }
 }
 
@@ -76,11 +97,32 @@ void app_event_free(app_event_t ev)
     free(e);
 }
 
+/*
+ * 分级时间轮, 每级64个槽, 第0级每槽1个tick, 
+ * 第n级每槽是第n-1级一圈的时间, 到期时逐级向下迁移
+ */
+#define TVN_BITS    6
+#define TVN_SIZE    (1 << TVN_BITS)
+#define TVN_MASK    (TVN_SIZE - 1)
+#define TV_LEVELS   4
+
 struct app {
     int epfd;
     int event_max;
     int event_cnt;
     bool need_exit;
+    struct app_event *cur;  /* 正在处理的事件, 处理中被删除时置空 */
+    struct epoll_event *batch;          /* 本轮epoll_wait返回的事件, 被删除的置空 */
+    int batch_nr;
+    const struct thread_sched *sched;   /* 运行app_exec的线程的调度策略 */
+
+    /* 定时器, 由timerfd驱动, 超时处理在app的线程中进行 */
+    int tfd;
+    struct app_event *tev;
+    pthread_mutex_t tlock;              /* 其他线程也可能加入定时器 */
+    unsigned long jiffies;              /* 时间轮当前的tick */
+    int timer_cnt;
+    struct list_head tv[TV_LEVELS][TVN_SIZE];
 };
 
 int app_add_event(app_t app, app_event_t ev)
@@ -111,16 +153,60 @@ int app_add_event(app_t app, app_event_t ev)
     } 
 
     if (op == EPOLL_CTL_ADD)
-        a->event_cnt++;
+        __sync_add_and_fetch(&a->event_cnt, 1);
 
     pr_debug("Event Add Success: fd = %d, events = %x\n", e->fd, epv.events);
     return 0;
 }
 
+/*
+ * 修改事件关注的读写类型, 只有类型确实改变且事件已加入epoll时
+ * 才调用EPOLL_CTL_MOD
+ */
+int app_mod_event(app_t app, app_event_t ev, bool rd, bool wr)
+{
+    struct app *a = app; 
+    struct app_event *e = ev; 
+    struct epoll_event epv;
+    uint32_t events;
+
+    events = e->events & ~(EPOLLIN | EPOLLOUT);
+    if (rd)
+        events |= EPOLLIN;
+    if (wr)
+        events |= EPOLLOUT;
+
+    if (events == e->events)
+        return 0;
+    e->events = events;
+
+    if (!e->epolled)
+        return 0;
+
+    epv.data.ptr = e;
+    epv.events = e->events;
+    if(epoll_ctl(a->epfd, EPOLL_CTL_MOD, e->fd, &epv) < 0) {
+        pr_debug("Event Mod failed: fd = %d\n", e->fd);
+        return -1;
+    } 
+
+    pr_debug("Event Mod Success: fd = %d, events = %x\n", e->fd, epv.events);
+    return 0;
+}
+
 int app_del_event(app_t app, app_event_t ev)
 {
     struct app *a = app; 
     struct app_event *e = ev; 
+    int i;
+
+    if (a->cur == e)
+        a->cur = NULL;
+    /* 事件删除后可能马上被释放, 本轮中还未处理到的不再处理 */
+    for (i = 0; i < a->batch_nr; i++) {
+        if (a->batch[i].data.ptr == e)
+            a->batch[i].data.ptr = NULL;
+    }
 
     if (e->epolled) {
         e->epolled = false;
@@ -128,13 +214,210 @@ int app_del_event(app_t app, app_event_t ev)
             pr_debug("Event Del failed: fd = %d\n", e->fd);
             return -1;
         } 
-        a->event_cnt--;
+        __sync_sub_and_fetch(&a->event_cnt, 1);
     }
 
     pr_debug("Event Del Success: fd = %d, events = %x\n", e->fd, e->events);
     return 0;
 }
 
+static unsigned long app_timer_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) 
+           / APP_TIMER_TICK_MS;
+}
+
+/*
+ * 按到期时间放入对应级别的槽中, 调用者持有tlock
+ */
+static void app_timer_queue(struct app *a, struct app_timer *t)
+{
+    unsigned long expires = t->expires;
+    long idx = expires - a->jiffies;
+    int lvl;
+
+    if (idx < 0) {
+        /* 已经到期, 放入下一个处理的槽 */
+        list_add_tail(&t->entry, &a->tv[0][a->jiffies & TVN_MASK]);
+        return;
+    }
+
+    for (lvl = 0; lvl < TV_LEVELS - 1; lvl++) {
+        if (idx < 1L << (TVN_BITS * (lvl + 1)))
+            break;
+    }
+    if (lvl == TV_LEVELS - 1 && idx >= 1L << (TVN_BITS * TV_LEVELS)) {
+        expires = a->jiffies + (1L << (TVN_BITS * TV_LEVELS)) - 1;
+        t->expires = expires;
+    }
+    list_add_tail(&t->entry, 
+                  &a->tv[lvl][(expires >> (TVN_BITS * lvl)) & TVN_MASK]);
+}
+
+/*
+ * 把第lvl级当前槽中的定时器重新放入较低的级别
+ */
+static int app_timer_cascade(struct app *a, int lvl)
+{
+    int idx = (a->jiffies >> (TVN_BITS * lvl)) & TVN_MASK;
+    struct app_timer *t, *tmp;
+    struct list_head list;
+
+    INIT_LIST_HEAD(&list);
+    list_splice_init(&a->tv[lvl][idx], &list);
+    list_for_each_entry_safe(t, tmp, &list, entry) 
+        app_timer_queue(a, t);
+    return idx;
+}
+
+static void app_timer_arm(struct app *a, bool on)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_interval.tv_nsec = APP_TIMER_TICK_MS * 1000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timerfd_settime(a->tfd, 0, &its, NULL)) 
+        perror("timerfd_settime");
+}
+
+static void app_timer_handler(int fd, void *arg)
+{
+    struct app *a = arg;
+    struct app_timer *t;
+    struct list_head list;
+    unsigned long now;
+    uint64_t cnt;
+    int idx, lvl;
+
+    if (read(a->tfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("app_timer_handler: read");
+
+    now = app_timer_clock();
+    INIT_LIST_HEAD(&list);
+
+    pthread_mutex_lock(&a->tlock);
+    while ((long)(now - a->jiffies) >= 0) {
+        idx = a->jiffies & TVN_MASK;
+        for (lvl = 1; !idx && lvl < TV_LEVELS; lvl++) 
+            idx = app_timer_cascade(a, lvl);
+        list_splice_tail_init(&a->tv[0][a->jiffies & TVN_MASK], &list);
+        a->jiffies++;
+    }
+
+    while (!list_empty(&list)) {
+        t = list_first_entry(&list, struct app_timer, entry);
+        list_del_init(&t->entry);
+        if (--a->timer_cnt == 0)
+            app_timer_arm(a, false);
+        /* 处理函数中可能重新加入或释放定时器 */
+        pthread_mutex_unlock(&a->tlock);
+        t->handler(t);
+        pthread_mutex_lock(&a->tlock);
+    }
+    pthread_mutex_unlock(&a->tlock);
+}
+
+void app_timer_init(struct app_timer *t, void (*handler)(struct app_timer *))
+{
+    INIT_LIST_HEAD(&t->entry);
+    t->handler = handler;
+}
+
+/*
+ * 定时器在ms毫秒后到期, 已加入的定时器重新设置到期时间
+ */
+int app_timer_mod(app_t app, struct app_timer *t, int ms)
+{
+    struct app *a = app; 
+
+    pthread_mutex_lock(&a->tlock);
+    if (list_empty(&t->entry)) {
+        if (a->timer_cnt++ == 0) {
+            /* 没有定时器时timerfd是停止的, jiffies可能已落后 */
+            a->jiffies = app_timer_clock();
+            app_timer_arm(a, true);
+        }
+    } else {
+        list_del(&t->entry);
+    }
+    t->expires = a->jiffies + (ms + APP_TIMER_TICK_MS - 1) / APP_TIMER_TICK_MS;
+    app_timer_queue(a, t);
+    pthread_mutex_unlock(&a->tlock);
+    return 0;
+}
+
+void app_timer_del(app_t app, struct app_timer *t)
+{
+    struct app *a = app; 
+
+    pthread_mutex_lock(&a->tlock);
+    if (!list_empty(&t->entry)) {
+        list_del_init(&t->entry);
+        if (--a->timer_cnt == 0)
+            app_timer_arm(a, false);
+    }
+    pthread_mutex_unlock(&a->tlock);
+}
+
+/*
+ * 当前的tick, 只在定时器处理时更新, 用于记录活动时间
+ */
+unsigned long app_timer_now(app_t app)
+{
+    struct app *a = app; 
+    return a->jiffies;
+}
+
+static int app_timer_setup(struct app *a)
+{
+    int i, j;
+
+    for (i = 0; i < TV_LEVELS; i++) 
+        for (j = 0; j < TVN_SIZE; j++) 
+            INIT_LIST_HEAD(&a->tv[i][j]);
+    a->jiffies = app_timer_clock();
+
+	if (pthread_mutex_init(&a->tlock, NULL)) {
+		perror("app_timer_setup: pthread_mutex_init");
+		return -1;
+	}
+
+    a->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (a->tfd == -1) {
+        perror("timerfd_create");
+        goto err_mutex;
+    }
+
+    a->tev = app_event_create(a->tfd);
+    if (a->tev == NULL)
+        goto err_fd;
+    app_event_add_notifier(a->tev, NOTIFIER_READ, app_timer_handler, a);
+    if (app_add_event(a, a->tev) == -1)
+        goto err_ev;
+    return 0;
+
+err_ev:
+    app_event_free(a->tev);
+err_fd:
+    close(a->tfd);
+err_mutex:
+    pthread_mutex_destroy(&a->tlock);
+    return -1;
+}
+
+static void app_timer_free(struct app *a)
+{
+    app_del_event(a, a->tev);
+    app_event_free(a->tev);
+    close(a->tfd);
+    pthread_mutex_destroy(&a->tlock);
+}
+
 app_t app_create(int event_max)
 {
     struct app *a = calloc(1, sizeof(struct app));
@@ -154,7 +437,12 @@ app_t app_create(int event_max)
         goto err_mem;
     }
 
+    if (app_timer_setup(a))
+        goto err_epoll;
+
     return a;
+err_epoll:
+    close(a->epfd);
 err_mem:
     free(a);
     return NULL;
@@ -163,10 +451,20 @@ err_mem:
 void app_free(app_t app)
 {
     struct app *a = app; 
+    app_timer_free(a);
     close(a->epfd);
     free(a);
 }
 
+/*
+ * 设置运行app_exec的线程的CPU绑定和调度策略, 在app_exec开始时生效
+ */
+void app_set_sched(app_t app, const struct thread_sched *ts)
+{
+    struct app *a = app; 
+    a->sched = ts;
+}
+
 int app_exec(app_t app)
 {
     struct app *a = app; 
@@ -175,6 +473,8 @@ int app_exec(app_t app)
     uint32_t event;
     int i, fds;
     
+    thread_set_sched(a->sched);
+
     a->need_exit = false;
     while (!a->need_exit) {
         fds = epoll_wait(a->epfd, events, a->event_max, 1000);
@@ -183,18 +483,40 @@ int app_exec(app_t app)
             return -1;
         }
 
+ 
+        /*
+         * 同一事件可能同时关注读写, 处理函数中可能删除并释放该事件, 
+         * 所以每调用一个处理函数后都要检查a->cur; 
+         * 处理函数也可能删除本轮中排在后面的事件(如超时关闭客户端), 
+         * 这些事件在app_del_event中被置空
+         */
+        a->batch    = events;
+        a->batch_nr = fds;
         for(i = 0; i < fds; i++){
             e = (struct app_event*)events[i].data.ptr;
+            if (e == NULL)
+                continue;
             event = events[i].events;
+            a->cur = e;
+
+            /* 没有错误处理函数时, 由读处理函数在读时发现错误 */
+            if (!(e->events & EPOLLERR) && (event & (EPOLLERR | EPOLLHUP)))
+                event |= EPOLLIN;
+
             if ((event & EPOLLIN) && (e->events & EPOLLIN)) 
                 e->handler_rd(e->fd, e->arg_rd);
 
-            if ((event & EPOLLOUT) && (e->events & EPOLLOUT)) 
+            if (a->cur && (event & EPOLLOUT) && (e->events & EPOLLOUT)) 
                 e->handler_wr(e->fd, e->arg_wr);
 
-            if ((event & EPOLLERR) && (e->events & EPOLLERR)) 
+            if (a->cur && (event & EPOLLERR) && (e->events & EPOLLERR)) 
                 e->handler_er(e->fd, e->arg_er);
+
+            if (a->cur && (event & EPOLLPRI) && (e->events & EPOLLPRI)) 
+                e->handler_pr(e->fd, e->arg_pr);
         } 
+        a->cur      = NULL;
+        a->batch_nr = 0;
     }
     return 0;
 }
@@ -205,11 +527,157 @@ void app_finish(app_t app)
     a->need_exit = true;
 }
 
+int app_get_event_cnt(app_t app)
+{
+    struct app *a = app; 
+    return a->event_cnt;
+}
+
+/*
+ * 多个app组成的组, 每个app在各自的线程中运行app_exec,
+ * 第0个app在调用app_group_exec的线程中运行
+ */
+struct app_group {
+    int             app_nr;
+    app_t           *apps;
+    pthread_t       *tids;
+    unsigned int    next;       /* 轮询起点 */
+};
+
+app_group_t app_group_create(int app_nr, int event_max)
+{
+    int i;
+    struct app_group *g = calloc(1, sizeof(struct app_group));
+    if (!g) {
+		perror("app_group_create");
+		return NULL;
+	}
+
+    if (app_nr < 1)
+        app_nr = DEF_APP_IN_GROUP;
+    g->app_nr = app_nr;
+
+    g->apps = calloc(app_nr, sizeof(app_t));
+    if (!g->apps) {
+		perror("app_group_create: calloc apps");
+        goto err_mem;
+    }
+
+    g->tids = calloc(app_nr, sizeof(pthread_t));
+    if (!g->tids) {
+		perror("app_group_create: calloc tids");
+        goto err_apps;
+    }
+
+    for (i = 0; i < app_nr; i++) {
+        g->apps[i] = app_create(event_max);
+        if (g->apps[i] == NULL)
+            goto err_app;
+    }
+
+    return g;
+err_app:
+    for (i = i - 1; i > -1; i--) 
+        app_free(g->apps[i]);
+    free(g->tids);
+err_apps:
+    free(g->apps);
+err_mem:
+    free(g);
+    return NULL;
+}
+
+void app_group_free(app_group_t grp)
+{
+    struct app_group *g = grp; 
+    int i;
+    for (i = 0; i < g->app_nr; i++) 
+        app_free(g->apps[i]);
+    free(g->tids);
+    free(g->apps);
+    free(g);
+}
+
+int app_group_get_nr(app_group_t grp)
+{
+    struct app_group *g = grp; 
+    return g->app_nr;
+}
+
+app_t app_group_get(app_group_t grp, int idx)
+{
+    struct app_group *g = grp; 
+    if (idx < 0 || idx >= g->app_nr) {
+        pr_debug("invalid arguments: idx = %d(max: %d)\n", idx, g->app_nr);
+        return NULL;
+    }
+    return g->apps[idx];
+}
+
+/*
+ * 选出当前事件数最少的app, 事件数相同时轮询.
+ * 有多个app时第0个只负责采集, 不参与分派
+ */
+app_t app_group_pick(app_group_t grp)
+{
+    struct app_group *g = grp; 
+    unsigned int start;
+    int i, idx, cnt, min_cnt, min_idx, first, nr;
+
+    first = g->app_nr > 1 ? 1 : 0;
+    nr    = g->app_nr - first;
+    start = __sync_fetch_and_add(&g->next, 1);
+    min_idx = first + start % nr;
+    min_cnt = app_get_event_cnt(g->apps[min_idx]);
+    for (i = 1; i < nr; i++) {
+        idx = first + (start + i) % nr;
+        cnt = app_get_event_cnt(g->apps[idx]);
+        if (cnt < min_cnt) {
+            min_cnt = cnt;
+            min_idx = idx;
+        }
+    }
+    return g->apps[min_idx];
+}
+
+static void *app_group_routine(void *arg)
+{
+    app_exec(arg);
+    return NULL;
+}
+
+int app_group_exec(app_group_t grp)
+{
+    struct app_group *g = grp; 
+    int i, ret;
+
+    for (i = 1; i < g->app_nr; i++) {
+        if (pthread_create(&g->tids[i], NULL, app_group_routine, g->apps[i])) {
+            perror("app_group_exec: pthread_create");
+            break;
+        }
+    }
+
+    ret = app_exec(g->apps[0]);
+
+    while (--i > 0) {
+        app_finish(g->apps[i]);
+        pthread_join(g->tids[i], NULL);
+    }
+    return ret;
+}
+
+void app_group_finish(app_group_t grp)
+{
+    struct app_group *g = grp; 
+    app_finish(g->apps[0]);
+}
+
 #if 0
 #include <cam/v4l2.h>
 
 
-void img_proc(const void *p, int size, void *arg)
+int img_proc(const void *p, int size, void *arg)
 {
     static int i;
     char buf[32];
@@ -221,6 +689,7 @@ void img_proc(const void *p, int size, void *arg)
     fclose(fp);
     fprintf(stdout, ".");
     fflush(stdout);
+    return V4L2_BUF_DONE;
 }
 
 int main(int argc, char *argv[])
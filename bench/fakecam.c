@@ -0,0 +1,601 @@
+/*
+ * 模拟摄像头和framebuffer, 用LD_PRELOAD加载, 在没有硬件的机器上运行
+ * VID_FUNC编译的wcamsrv(不使用S3C_FB和S3C_JPG).
+ *
+ * 编译: make bench/fakecam.so
+ * 运行: LD_PRELOAD=bench/fakecam.so ./wcamsrv
+ *
+ * 打开DEF_V4L_DEV和DEF_FB_DEV时返回模拟设备, 其他文件不受影响.
+ * 摄像头支持JPEG和YUYV, 640x480和320x240, 30和15帧/秒,
+ * 几个用户类控制项, 按帧率用eventfd通知有帧可取.
+ * 环境变量:
+ *   FAKECAM_NO_EXT_CTRLS   扩展控制项ioctl返回EINVAL, 同老的内核
+ *   FAKECAM_PARM_BUSY      采集中S_PARM返回EBUSY, 同uvc
+ *   FAKECAM_ORPHAN         REQBUFS(0)可以释放仍被映射的缓冲区, 同5.0以后的内核
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/videodev2.h>
+#include <linux/fb.h>
+
+#include <pthread.h>
+#include <jpeglib.h>
+
+#include "cam/v4l2.h"
+#include "cam/fbd.h"
+
+#define FC_BUF_MAX      8
+#define FC_PAGE_ALIGN(x) (((x) + 4095) & ~4095UL)
+
+struct fc_buf {
+    void            *start;             /* 模拟驱动写入帧数据的映射 */
+    __u32           off;
+    bool            queued;             /* 在驱动的输入队列中 */
+    bool            done;               /* 已采集, 等待DQBUF */
+    void            *user;              /* 用户的映射, 没有时为NULL */
+};
+
+struct fc_ctrl {
+    __u32           id;
+    __u32           type;
+    const char      *name;
+    __s32           min, max, def, val;
+};
+
+static struct fc_ctrl fc_ctrls[] = {
+    { V4L2_CID_BRIGHTNESS,         V4L2_CTRL_TYPE_INTEGER, "Brightness", 0, 255, 128 },
+    { V4L2_CID_CONTRAST,           V4L2_CTRL_TYPE_INTEGER, "Contrast",   0, 255, 32  },
+    { V4L2_CID_SATURATION,         V4L2_CTRL_TYPE_INTEGER, "Saturation", 0, 255, 64  },
+    { V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CTRL_TYPE_BOOLEAN, "White Balance, Auto", 0, 1, 1 },
+};
+#define FC_CTRLS_NR     (sizeof(fc_ctrls) / sizeof(fc_ctrls[0]))
+
+static const __u32 fc_fmts[]     = { V4L2_PIX_FMT_JPEG, V4L2_PIX_FMT_YUYV };
+static const __u32 fc_sizes[][2] = { { 640, 480 }, { 320, 240 } };
+static const __u32 fc_fps[]      = { 30, 15 };
+
+static struct {
+    pthread_mutex_t mutex;
+    int             fd;                 /* eventfd, 有帧可取时可读 */
+    int             mem;                /* 当前缓冲区所在的memfd */
+    bool            streaming;
+    __u32           pixfmt, width, height, fps;
+    struct fc_buf   buf[FC_BUF_MAX];
+    __u32           buf_nr, buf_len;
+    __u8            *jpg;               /* 当前帧大小的一帧JPEG */
+    unsigned long   jpg_len;
+    bool            no_ext, parm_busy, orphan;
+
+    int             fb_fd;
+    int             fb_mem;
+    struct fb_var_screeninfo vinfo;
+} fc = {
+    .mutex  = PTHREAD_MUTEX_INITIALIZER,
+    .fd     = -1,
+    .mem    = -1,
+    .fb_fd  = -1,
+    .fb_mem = -1,
+};
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static int (*real_munmap)(void *, size_t);
+
+__attribute__((constructor)) static void fc_init(void)
+{
+    int i;
+
+    real_open   = dlsym(RTLD_NEXT, "open");
+    real_close  = dlsym(RTLD_NEXT, "close");
+    real_ioctl  = dlsym(RTLD_NEXT, "ioctl");
+    real_mmap   = dlsym(RTLD_NEXT, "mmap");
+    real_munmap = dlsym(RTLD_NEXT, "munmap");
+    fc.no_ext    = getenv("FAKECAM_NO_EXT_CTRLS") != NULL;
+    fc.parm_busy = getenv("FAKECAM_PARM_BUSY") != NULL;
+    fc.orphan    = getenv("FAKECAM_ORPHAN") != NULL;
+    for (i = 0; i < FC_CTRLS_NR; i++)
+        fc_ctrls[i].val = fc_ctrls[i].def;
+}
+
+/*
+ * 按当前帧大小压缩一帧噪声图像, 作为每一帧JPEG的内容, 
+ * 大小接近真实摄像头的帧
+ */
+static void fc_make_jpg(void)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row;
+    __u8 *line;
+    int i, j;
+
+    free(fc.jpg);
+    fc.jpg     = NULL;
+    fc.jpg_len = 0;
+    line = malloc(fc.width * 3);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &fc.jpg, &fc.jpg_len);
+    cinfo.image_width      = fc.width;
+    cinfo.image_height     = fc.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space   = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_start_compress(&cinfo, TRUE);
+    row = line;
+    for (i = 0; i < fc.height; i++) {
+        for (j = 0; j < fc.width * 3; j++)
+            line[j] = rand();
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(line);
+}
+
+static __u32 fc_sizeimage(void)
+{
+    return fc.width * fc.height * 2;
+}
+
+/*
+ * 采集线程: 按帧率把一个已入队的缓冲区标记为完成, 写eventfd通知
+ */
+static void *fc_capture_thread(void *arg)
+{
+    struct timespec ts;
+    uint64_t one = 1;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&fc.mutex);
+        ts.tv_sec  = 0;
+        ts.tv_nsec = 1000000000L / (fc.fps ? fc.fps : 30);
+        if (fc.streaming) {
+            for (i = 0; i < fc.buf_nr; i++) {
+                if (fc.buf[i].queued)
+                    break;
+            }
+            if (i < fc.buf_nr) {
+                fc.buf[i].queued = false;
+                fc.buf[i].done   = true;
+                write(fc.fd, &one, sizeof(one));
+            }
+        }
+        pthread_mutex_unlock(&fc.mutex);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static struct fc_ctrl *fc_ctrl_find(__u32 id)
+{
+    int i;
+    for (i = 0; i < FC_CTRLS_NR; i++) {
+        if (fc_ctrls[i].id == id)
+            return &fc_ctrls[i];
+    }
+    return NULL;
+}
+
+static int fc_queryctrl(struct v4l2_queryctrl *q)
+{
+    struct fc_ctrl *c = NULL;
+    __u32 id = q->id & ~V4L2_CTRL_FLAG_NEXT_CTRL;
+    int i;
+
+    if (q->id & V4L2_CTRL_FLAG_NEXT_CTRL) {
+        for (i = 0; i < FC_CTRLS_NR; i++) {
+            if (fc_ctrls[i].id > id && (!c || fc_ctrls[i].id < c->id))
+                c = &fc_ctrls[i];
+        }
+    } else {
+        c = fc_ctrl_find(id);
+    }
+    if (!c)
+        return EINVAL;
+
+    memset(q, 0, sizeof(*q));
+    q->id            = c->id;
+    q->type          = c->type;
+    q->minimum       = c->min;
+    q->maximum       = c->max;
+    q->step          = 1;
+    q->default_value = c->def;
+    strncpy((char*)q->name, c->name, sizeof(q->name) - 1);
+    return 0;
+}
+
+static int fc_ext_ctrls(struct v4l2_ext_controls *cs, bool set)
+{
+    struct fc_ctrl *c;
+    int i;
+
+    if (fc.no_ext)
+        return EINVAL;
+    for (i = 0; i < cs->count; i++) {
+        c = fc_ctrl_find(cs->controls[i].id);
+        if (!c || (set && (cs->controls[i].value < c->min ||
+                           cs->controls[i].value > c->max))) {
+            cs->error_idx = i;
+            return EINVAL;
+        }
+    }
+    for (i = 0; i < cs->count; i++) {
+        c = fc_ctrl_find(cs->controls[i].id);
+        if (set)
+            c->val = cs->controls[i].value;
+        else
+            cs->controls[i].value = c->val;
+    }
+    return 0;
+}
+
+static int fc_reqbufs(struct v4l2_requestbuffers *req)
+{
+    int i;
+
+    if (fc.streaming)
+        return EBUSY;
+    for (i = 0; i < fc.buf_nr; i++) {
+        if (fc.buf[i].user && !fc.orphan)
+            return EBUSY;
+    }
+
+    /* 被映射的缓冲区由用户munmap时释放, memfd的映射不受close影响 */
+    for (i = 0; i < fc.buf_nr; i++)
+        real_munmap(fc.buf[i].start, fc.buf_len);
+    if (fc.mem >= 0)
+        real_close(fc.mem);
+    fc.mem    = -1;
+    fc.buf_nr = 0;
+
+    if (fc.orphan)
+        req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP |
+                            V4L2_BUF_CAP_SUPPORTS_ORPHANED_BUFS;
+    else
+        req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP;
+    if (req->count == 0)
+        return 0;
+
+    if (req->count > FC_BUF_MAX)
+        req->count = FC_BUF_MAX;
+    fc.buf_len = FC_PAGE_ALIGN(fc_sizeimage());
+    fc.mem = memfd_create("fakecam", 0);
+    if (fc.mem < 0 || ftruncate(fc.mem, fc.buf_len * req->count))
+        return ENOMEM;
+    for (i = 0; i < req->count; i++) {
+        memset(&fc.buf[i], 0, sizeof(fc.buf[i]));
+        fc.buf[i].off   = i * fc.buf_len;
+        fc.buf[i].start = real_mmap(NULL, fc.buf_len, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fc.mem, fc.buf[i].off);
+        if (fc.pixfmt == V4L2_PIX_FMT_YUYV)
+            memset(fc.buf[i].start, 0x80, fc_sizeimage());
+        else
+            memcpy(fc.buf[i].start, fc.jpg, fc.jpg_len);
+    }
+    fc.buf_nr = req->count;
+    return 0;
+}
+
+static void fc_fill_fmt(struct v4l2_format *f)
+{
+    memset(&f->fmt.pix, 0, sizeof(f->fmt.pix));
+    f->fmt.pix.width        = fc.width;
+    f->fmt.pix.height       = fc.height;
+    f->fmt.pix.pixelformat  = fc.pixfmt;
+    f->fmt.pix.field        = V4L2_FIELD_NONE;
+    f->fmt.pix.bytesperline = fc.pixfmt == V4L2_PIX_FMT_YUYV ? fc.width * 2 : 0;
+    f->fmt.pix.sizeimage    = fc_sizeimage();
+}
+
+static int fc_cam_ioctl(unsigned long req, void *arg)
+{
+    struct v4l2_capability *cap;
+    struct v4l2_fmtdesc *fd;
+    struct v4l2_frmsizeenum *fs;
+    struct v4l2_frmivalenum *fi;
+    struct v4l2_format *f;
+    struct v4l2_streamparm *parm;
+    struct v4l2_buffer *b;
+    struct v4l2_control *ctl;
+    struct fc_ctrl *c;
+    uint64_t cnt;
+    int i;
+
+    switch (req) {
+    case VIDIOC_QUERYCAP:
+        cap = arg;
+        memset(cap, 0, sizeof(*cap));
+        strcpy((char*)cap->driver, "fakecam");
+        strcpy((char*)cap->card, "fakecam");
+        cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        return 0;
+
+    case VIDIOC_ENUM_FMT:
+        fd = arg;
+        if (fd->index >= 2)
+            return EINVAL;
+        fd->pixelformat = fc_fmts[fd->index];
+        fd->flags = fd->index == 0 ? V4L2_FMT_FLAG_COMPRESSED : 0;
+        strcpy((char*)fd->description, fd->index == 0 ? "JFIF JPEG" : "YUYV 4:2:2");
+        return 0;
+    case VIDIOC_ENUM_FRAMESIZES:
+        fs = arg;
+        if (fs->index >= 2)
+            return EINVAL;
+        fs->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+        fs->discrete.width  = fc_sizes[fs->index][0];
+        fs->discrete.height = fc_sizes[fs->index][1];
+        return 0;
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+        fi = arg;
+        if (fi->index >= 2)
+            return EINVAL;
+        fi->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+        fi->discrete.numerator   = 1;
+        fi->discrete.denominator = fc_fps[fi->index];
+        return 0;
+
+    case VIDIOC_G_FMT:
+        fc_fill_fmt(arg);
+        return 0;
+    case VIDIOC_S_FMT:
+        f = arg;
+        if (fc.streaming || fc.buf_nr)
+            return EBUSY;
+        fc.pixfmt = f->fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV ?
+                    V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_JPEG;
+        fc.width  = f->fmt.pix.width  >= 640 ? 640 : 320;
+        fc.height = f->fmt.pix.height >= 480 ? 480 : 240;
+        fc_make_jpg();
+        fc_fill_fmt(f);
+        return 0;
+
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM:
+        parm = arg;
+        if (req == VIDIOC_S_PARM) {
+            if (fc.streaming && fc.parm_busy)
+                return EBUSY;
+            if (parm->parm.capture.timeperframe.numerator)
+                fc.fps = parm->parm.capture.timeperframe.denominator /
+                         parm->parm.capture.timeperframe.numerator >= 30 ? 30 : 15;
+        }
+        memset(&parm->parm, 0, sizeof(parm->parm));
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        parm->parm.capture.timeperframe.numerator   = 1;
+        parm->parm.capture.timeperframe.denominator = fc.fps;
+        return 0;
+
+    case VIDIOC_QUERYCTRL:
+        return fc_queryctrl(arg);
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL:
+        ctl = arg;
+        c = fc_ctrl_find(ctl->id);
+        if (!c)
+            return EINVAL;
+        if (req == VIDIOC_G_CTRL) {
+            ctl->value = c->val;
+            return 0;
+        }
+        if (ctl->value < c->min || ctl->value > c->max)
+            return ERANGE;
+        c->val = ctl->value;
+        return 0;
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+        return fc_ext_ctrls(arg, req == VIDIOC_S_EXT_CTRLS);
+
+    case VIDIOC_REQBUFS:
+        return fc_reqbufs(arg);
+    case VIDIOC_QUERYBUF:
+        b = arg;
+        if (b->index >= fc.buf_nr)
+            return EINVAL;
+        b->length   = fc.buf_len;
+        b->m.offset = fc.buf[b->index].off;
+        return 0;
+    case VIDIOC_QBUF:
+        b = arg;
+        if (b->index >= fc.buf_nr || fc.buf[b->index].queued ||
+            fc.buf[b->index].done)
+            return EINVAL;
+        fc.buf[b->index].queued = true;
+        return 0;
+    case VIDIOC_DQBUF:
+        b = arg;
+        if (read(fc.fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+            return EAGAIN;
+        for (i = 0; i < fc.buf_nr; i++) {
+            if (fc.buf[i].done)
+                break;
+        }
+        if (i == fc.buf_nr)
+            return EAGAIN;
+        fc.buf[i].done = false;
+        b->index     = i;
+        b->bytesused = fc.pixfmt == V4L2_PIX_FMT_YUYV ? fc_sizeimage() : fc.jpg_len;
+        return 0;
+    case VIDIOC_STREAMON:
+        if (!fc.fps)
+            fc.fps = 30;
+        fc.streaming = true;
+        return 0;
+    case VIDIOC_STREAMOFF:
+        fc.streaming = false;
+        while (read(fc.fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+            ;
+        for (i = 0; i < fc.buf_nr; i++)
+            fc.buf[i].queued = fc.buf[i].done = false;
+        return 0;
+
+    default:
+        /* CROPCAP, 控制项事件等 */
+        return EINVAL;
+    }
+}
+
+static int fc_fb_ioctl(unsigned long req, void *arg)
+{
+    switch (req) {
+    case FBIOGET_VSCREENINFO:
+        memcpy(arg, &fc.vinfo, sizeof(fc.vinfo));
+        return 0;
+    case FBIOPUT_VSCREENINFO:
+        memcpy(&fc.vinfo, arg, sizeof(fc.vinfo));
+        return 0;
+    default:
+        return EINVAL;
+    }
+}
+
+static int fc_open_cam(void)
+{
+    static pthread_t tid;
+    int fd;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (fd < 0)
+        return -1;
+    pthread_mutex_lock(&fc.mutex);
+    fc.fd     = fd;
+    fc.pixfmt = V4L2_PIX_FMT_JPEG;
+    fc.width  = 640;
+    fc.height = 480;
+    fc.fps    = 30;
+    fc_make_jpg();
+    if (!tid)
+        pthread_create(&tid, NULL, fc_capture_thread, NULL);
+    pthread_mutex_unlock(&fc.mutex);
+    return fd;
+}
+
+static int fc_open_fb(void)
+{
+    int fd = eventfd(0, 0);
+    if (fd < 0)
+        return -1;
+    fc.fb_fd = fd;
+    fc.fb_mem = memfd_create("fakefb", 0);
+    memset(&fc.vinfo, 0, sizeof(fc.vinfo));
+    fc.vinfo.xres = fc.vinfo.xres_virtual = 640;
+    fc.vinfo.yres = fc.vinfo.yres_virtual = 480;
+    fc.vinfo.bits_per_pixel = 16;
+    return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode = 0;
+
+    if (!strcmp(path, DEF_V4L_DEV))
+        return fc_open_cam();
+    if (!strcmp(path, DEF_FB_DEV))
+        return fc_open_fb();
+
+    if (flags & O_CREAT) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    return real_open(path, flags, mode);
+}
+
+int close(int fd)
+{
+    if (fd >= 0 && fd == fc.fd) {
+        pthread_mutex_lock(&fc.mutex);
+        fc.streaming = false;
+        fc.fd = -1;
+        pthread_mutex_unlock(&fc.mutex);
+    }
+    return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+    va_list ap;
+    void *arg;
+    int err;
+
+    va_start(ap, req);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if (fd < 0 || (fd != fc.fd && fd != fc.fb_fd))
+        return real_ioctl(fd, req, arg);
+
+    /* 内核只用低32位, xioctl的int参数会被符号扩展 */
+    pthread_mutex_lock(&fc.mutex);
+    err = fd == fc.fd ? fc_cam_ioctl((unsigned int)req, arg) : 
+                        fc_fb_ioctl((unsigned int)req, arg);
+    pthread_mutex_unlock(&fc.mutex);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    void *p;
+    int i;
+
+    if (fd >= 0 && fd == fc.fb_fd) {
+        if (ftruncate(fc.fb_mem, len))
+            return MAP_FAILED;
+        return real_mmap(addr, len, prot, flags, fc.fb_mem, off);
+    }
+    if (fd < 0 || fd != fc.fd)
+        return real_mmap(addr, len, prot, flags, fd, off);
+
+    pthread_mutex_lock(&fc.mutex);
+    for (i = 0; i < fc.buf_nr; i++) {
+        if (fc.buf[i].off == off)
+            break;
+    }
+    if (i == fc.buf_nr || fc.buf[i].user) {
+        pthread_mutex_unlock(&fc.mutex);
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    p = real_mmap(addr, len, prot, flags, fc.mem, off);
+    if (p != MAP_FAILED)
+        fc.buf[i].user = p;
+    pthread_mutex_unlock(&fc.mutex);
+    return p;
+}
+
+/*
+ * 记录用户释放的映射, 没有FAKECAM_ORPHAN时仍被映射的缓冲区不能释放
+ */
+int munmap(void *addr, size_t len)
+{
+    int i;
+
+    pthread_mutex_lock(&fc.mutex);
+    for (i = 0; i < fc.buf_nr; i++) {
+        if (fc.buf[i].user == addr)
+            fc.buf[i].user = NULL;
+    }
+    pthread_mutex_unlock(&fc.mutex);
+    return real_munmap(addr, len);
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# 事件循环个数(app_in_group)与客户端数的吞吐量扫描, 在目标机器上运行:
+#   bench/group_sweep.sh [wcamsrv] [net_bench]
+# wcamsrv用FUNC="-DSYS_FUNC"编译即可. 服务器从/root/wcamsrv/config
+# (DEF_CFG_PATH)读配置, 脚本临时改写其中的app_in_group, 结束后恢复.
+# 环境变量APPS, CLIS指定扫描的事件循环个数和客户端数
+#
+SRV=${1:-./wcamsrv}
+NB=${2:-bench/net_bench}
+CFG=/root/wcamsrv/config
+APPS=${APPS:-"1 2 4 8"}
+CLIS=${CLIS:-"1 8 64 256"}
+
+[ -f $CFG ] || { echo "$CFG not found"; exit 1; }
+cp $CFG $CFG.sweep || exit 1
+trap 'mv $CFG.sweep $CFG' EXIT INT TERM
+
+echo "# $(uname -m) $(uname -r), $(nproc) CPU," \
+     "$(grep -m1 'model name' /proc/cpuinfo | cut -d: -f2)"
+printf "%-8s" "apps"
+for c in $CLIS; do printf "%12s" "$c cli"; done
+echo
+
+for a in $APPS; do
+    sed "s/^app_in_group.*/app_in_group        = $a/" $CFG.sweep > $CFG
+    $SRV >/dev/null 2>&1 &
+    pid=$!
+    sleep 1
+    printf "%-8s" $a
+    for c in $CLIS; do
+        # 每个客户端一个请求在途, 总请求数固定
+        r=$($NB req -c $c -k 1 -n $((200000 / c)) | sed -n 's/.* \([0-9]*\) req\/s.*/\1/p')
+        printf "%12s" "${r:-fail}"
+    done
+    echo
+    kill $pid
+    wait $pid 2>/dev/null
+done
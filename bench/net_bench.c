@@ -0,0 +1,399 @@
+/*
+ * wcamsrv的网络性能测试客户端, 只发送SYS_VERSION请求,
+ * 服务器用FUNC="-DSYS_FUNC"编译即可, 不需要摄像头.
+ * -v时改为发送VID_GET_FRMSIZ, 用于没有SYS_FUNC的VID_FUNC服务器, 
+ * 没有摄像头时可以用bench/fakecam.so模拟.
+ *
+ * 编译: make bench
+ * 运行: bench/net_bench [-h 地址] [-P 端口] [-p 服务器进程号] [-v] 模式 [参数]
+ *   req   [-c 连接数] [-k 每次连续发送的请求数] [-n 每个连接的请求数]
+ *         每个连接一个线程, 一次write连续发送k个请求, 收齐应答后再发, 测请求/秒
+ *   conn  [-c 线程数] [-d 秒数]
+ *         各线程反复连接, 发一个请求, 收到应答后断开, 测连接/秒
+ *   storm [-c 连接数]
+ *         同时发起c个连接并各发一个请求, 测全部收到应答的时间
+ *   idle  [-c 连接数]
+ *         建立c个空闲连接(各完成一个请求), 读服务器的VmRSS, 需要-p
+ *
+ * 服务器是bench/wcamsrv_sysc时, -p使测试开始和结束时各发送一次SIGUSR1,
+ * 服务器打印测试期间各网络系统调用的次数
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+
+#include <pthread.h>
+
+#include <cam/protocal.h>
+
+#define DEF_BENCH_PORT      19868
+#define BENCH_RSP_MAX       FRAME_MAX_SZ
+
+static struct sockaddr_in srv_addr;
+static pid_t srv_pid;
+static int cli_nr   = 8;
+static int pipe_nr  = 16;
+static int req_nr   = 20000;
+static int duration = 3;
+
+static volatile bool stop;
+static unsigned long conn_done, conn_fail;
+
+static const __u8 ver_req[FRAME_HDR_SZ] = {
+    0, (TYPE_SREQ << TYPE_BIT_POS) | SUBS_SYS, 0    /* SYS_VERSION */
+};
+static const __u8 frmsiz_req[FRAME_HDR_SZ] = {
+    0, (TYPE_SREQ << TYPE_BIT_POS) | SUBS_VID, 0x10 /* VID_GET_FRMSIZ */
+};
+static const __u8 *req_hdr = ver_req;               /* 测试发送的请求 */
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_signal_srv(void)
+{
+    if (srv_pid > 0 && kill(srv_pid, SIGUSR1))
+        perror("kill");
+    /* 给服务器打印的时间 */
+    if (srv_pid > 0)
+        usleep(100000);
+}
+
+static int bench_connect(void)
+{
+    int sock, on = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(sock, (struct sockaddr *)&srv_addr, sizeof(srv_addr))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int bench_read_full(int sock, __u8 *buf, int len)
+{
+    int res, pos = 0;
+
+    while (pos < len) {
+        res = read(sock, &buf[pos], len - pos);
+        if (res <= 0)
+            return -1;
+        pos += res;
+    }
+    return 0;
+}
+
+/*
+ * 读一个通用帧应答
+ */
+static int bench_read_rsp(int sock)
+{
+    __u8 buf[BENCH_RSP_MAX];
+
+    if (bench_read_full(sock, buf, FRAME_HDR_SZ))
+        return -1;
+    return bench_read_full(sock, &buf[FRAME_HDR_SZ], buf[LEN_POS]);
+}
+
+static void *bench_req_thread(void *arg)
+{
+    __u8 *reqs;
+    int sock, i, j;
+
+    sock = bench_connect();
+    if (sock == -1)
+        return (void *)-1L;
+    reqs = malloc(pipe_nr * FRAME_HDR_SZ);
+    if (!reqs) {
+        close(sock);
+        return (void *)-1L;
+    }
+    for (i = 0; i < pipe_nr; i++)
+        memcpy(&reqs[i * FRAME_HDR_SZ], req_hdr, FRAME_HDR_SZ);
+
+    for (i = 0; i < req_nr; i += pipe_nr) {
+        if (write(sock, reqs, pipe_nr * FRAME_HDR_SZ) != pipe_nr * FRAME_HDR_SZ)
+            break;
+        for (j = 0; j < pipe_nr; j++)
+            if (bench_read_rsp(sock))
+                break;
+        if (j < pipe_nr)
+            break;
+    }
+    free(reqs);
+    close(sock);
+    return i < req_nr ? (void *)-1L : NULL;
+}
+
+static int bench_req(void)
+{
+    pthread_t *tids = calloc(cli_nr, sizeof(pthread_t));
+    void *ret;
+    int i, fail = 0;
+    double t0, t1;
+
+    if (!tids)
+        return -1;
+    req_nr = (req_nr + pipe_nr - 1) / pipe_nr * pipe_nr;
+
+    bench_signal_srv();
+    t0 = bench_now();
+    for (i = 0; i < cli_nr; i++)
+        pthread_create(&tids[i], NULL, bench_req_thread, NULL);
+    for (i = 0; i < cli_nr; i++) {
+        pthread_join(tids[i], &ret);
+        if (ret)
+            fail++;
+    }
+    t1 = bench_now();
+    bench_signal_srv();
+
+    printf("req: %d clients x %d requests, pipeline %d: %.3f s, %.0f req/s%s\n",
+           cli_nr, req_nr, pipe_nr, t1 - t0,
+           (double)cli_nr * req_nr / (t1 - t0), fail ? " (some clients failed)" : "");
+    free(tids);
+    return fail ? -1 : 0;
+}
+
+static void *bench_conn_thread(void *arg)
+{
+    struct linger lg = {1, 0};  /* 以RST断开, 不留TIME_WAIT占用本地端口 */
+    int sock;
+
+    while (!stop) {
+        sock = bench_connect();
+        if (sock == -1) {
+            __sync_add_and_fetch(&conn_fail, 1);
+            continue;
+        }
+        if (write(sock, req_hdr, FRAME_HDR_SZ) == FRAME_HDR_SZ &&
+            bench_read_rsp(sock) == 0)
+            __sync_add_and_fetch(&conn_done, 1);
+        else
+            __sync_add_and_fetch(&conn_fail, 1);
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(sock);
+    }
+    return NULL;
+}
+
+static int bench_conn(void)
+{
+    pthread_t *tids = calloc(cli_nr, sizeof(pthread_t));
+    int i;
+    double t0, t1;
+
+    if (!tids)
+        return -1;
+
+    bench_signal_srv();
+    t0 = bench_now();
+    for (i = 0; i < cli_nr; i++)
+        pthread_create(&tids[i], NULL, bench_conn_thread, NULL);
+    sleep(duration);
+    stop = true;
+    for (i = 0; i < cli_nr; i++)
+        pthread_join(tids[i], NULL);
+    t1 = bench_now();
+    bench_signal_srv();
+
+    printf("conn: %d threads, %.3f s: %lu connections, %.0f conn/s, %lu failed\n",
+           cli_nr, t1 - t0, conn_done, conn_done / (t1 - t0), conn_fail);
+    free(tids);
+    return 0;
+}
+
+/*
+ * 同时发起cli_nr个非阻塞连接, 连上后发请求, 记录收齐所有应答的时间.
+ * 监听队列溢出时内核丢弃SYN, 客户端要等SYN重传(1秒起)
+ */
+static int bench_storm(void)
+{
+    struct pollfd *pfds = calloc(cli_nr, sizeof(struct pollfd));
+    int *state = calloc(cli_nr, sizeof(int));   /* 0连接中, 1已发请求, 2完成 */
+    int i, left, fail = 0, err;
+    socklen_t len;
+    double t0, t1;
+
+    if (!pfds || !state)
+        return -1;
+
+    bench_signal_srv();
+    t0 = bench_now();
+    for (i = 0; i < cli_nr; i++) {
+        pfds[i].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        pfds[i].events = POLLOUT;
+        if (pfds[i].fd == -1 ||
+            (connect(pfds[i].fd, (struct sockaddr *)&srv_addr,
+                     sizeof(srv_addr)) && errno != EINPROGRESS)) {
+            perror("storm: connect");
+            return -1;
+        }
+    }
+
+    for (left = cli_nr; left > 0; ) {
+        if (poll(pfds, cli_nr, 10000) <= 0) {
+            fail += left;
+            break;
+        }
+        for (i = 0; i < cli_nr; i++) {
+            if (!pfds[i].revents)
+                continue;
+            if (state[i] == 0) {
+                len = sizeof(err);
+                getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err || write(pfds[i].fd, req_hdr, FRAME_HDR_SZ) != FRAME_HDR_SZ) {
+                    fail++;
+                    left--;
+                    pfds[i].fd = -pfds[i].fd;
+                    continue;
+                }
+                state[i] = 1;
+                pfds[i].events = POLLIN;
+            } else {
+                /* 应答很小, 一次就能读到 */
+                __u8 buf[BENCH_RSP_MAX];
+                if (read(pfds[i].fd, buf, sizeof(buf)) <= 0)
+                    fail++;
+                state[i] = 2;
+                left--;
+                pfds[i].fd = -pfds[i].fd;
+            }
+        }
+    }
+    t1 = bench_now();
+    bench_signal_srv();
+
+    printf("storm: %d connections: all answered in %.3f s (%.0f conn/s), %d failed\n",
+           cli_nr, t1 - t0, cli_nr / (t1 - t0), fail);
+    for (i = 0; i < cli_nr; i++)
+        close(pfds[i].fd < 0 ? -pfds[i].fd : pfds[i].fd);
+    free(pfds);
+    free(state);
+    return 0;
+}
+
+static long bench_srv_rss_kb(void)
+{
+    char path[64], line[128];
+    long kb = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", srv_pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int bench_idle(void)
+{
+    int *socks = calloc(cli_nr, sizeof(int));
+    long rss0, rss1;
+    int i, n;
+
+    if (!socks || srv_pid <= 0) {
+        fprintf(stderr, "idle: need -p\n");
+        return -1;
+    }
+
+    rss0 = bench_srv_rss_kb();
+    for (n = 0; n < cli_nr; n++) {
+        socks[n] = bench_connect();
+        if (socks[n] == -1)
+            break;
+        /* 收到应答说明服务器已完成该客户端的初始化 */
+        if (write(socks[n], req_hdr, FRAME_HDR_SZ) != FRAME_HDR_SZ ||
+            bench_read_rsp(socks[n])) {
+            close(socks[n]);
+            break;
+        }
+    }
+    usleep(200000);
+    rss1 = bench_srv_rss_kb();
+
+    printf("idle: %d clients: server VmRSS %ld kB -> %ld kB, %.1f kB per client\n",
+           n, rss0, rss1, n ? (double)(rss1 - rss0) / n : 0.0);
+    for (i = 0; i < n; i++)
+        close(socks[i]);
+    free(socks);
+    return n < cli_nr ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    char *mode;
+    int opt;
+
+    srv_addr.sin_family      = AF_INET;
+    srv_addr.sin_port        = htons(DEF_BENCH_PORT);
+    srv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while ((opt = getopt(argc, argv, "h:P:p:vc:k:n:d:")) != -1) {
+        switch (opt) {
+        case 'h': inet_aton(optarg, &srv_addr.sin_addr);    break;
+        case 'P': srv_addr.sin_port = htons(atoi(optarg));  break;
+        case 'p': srv_pid  = atoi(optarg);                  break;
+        case 'v': req_hdr  = frmsiz_req;                    break;
+        case 'c': cli_nr   = atoi(optarg);                  break;
+        case 'k': pipe_nr  = atoi(optarg);                  break;
+        case 'n': req_nr   = atoi(optarg);                  break;
+        case 'd': duration = atoi(optarg);                  break;
+        default:
+            fprintf(stderr, "usage: %s [-h addr] [-P port] [-p pid] [-v] "
+                    "req|conn|storm|idle [-c n] [-k n] [-n n] [-d s]\n", argv[0]);
+            return 1;
+        }
+    }
+    mode = optind < argc ? argv[optind] : "req";
+    if (cli_nr <= 0 || pipe_nr <= 0 || req_nr <= 0)
+        return 1;
+
+    /* storm和idle需要大量描述符 */
+    if (0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!strcmp(mode, "req"))
+        return bench_req() ? 1 : 0;
+    if (!strcmp(mode, "conn"))
+        return bench_conn() ? 1 : 0;
+    if (!strcmp(mode, "storm"))
+        return bench_storm() ? 1 : 0;
+    if (!strcmp(mode, "idle"))
+        return bench_idle() ? 1 : 0;
+    fprintf(stderr, "unknown mode: %s\n", mode);
+    return 1;
+}
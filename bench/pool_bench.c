@@ -0,0 +1,84 @@
+/*
+ * 线程池任务队列的竞争测试: P个生产者线程同时加入任务, W个线程执行, 
+ * 任务只把计数加1, 测出的是加入和取出任务的开销.
+ *
+ * 编译: make bench
+ * 运行: bench/pool_bench [生产者数 线程数 每个生产者的任务数]
+ *
+ * 与原来的链表实现比较时, 从dbc486d取出旧的threadpool.c和include/, 
+ * 加-DPOOL_BENCH_OLD与本文件一起编译
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <cam/threadpool.h>
+
+static volatile unsigned long done_cnt;
+static thread_pool_t pool;
+static int task_nr;
+
+static void *bench_task(void *arg)
+{
+    __sync_add_and_fetch(&done_cnt, 1);
+    return NULL;
+}
+
+static void *bench_producer(void *arg)
+{
+    int i;
+    for (i = 0; i < task_nr; i++) {
+        while (pool_add_worker(pool, bench_task, NULL)) 
+            sched_yield();
+    }
+    return NULL;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int prod_nr   = argc > 1 ? atoi(argv[1]) : 4;
+    int thread_nr = argc > 2 ? atoi(argv[2]) : DEF_THREAD_IN_POOL;
+    pthread_t *tids;
+    unsigned long total;
+    double t0, t1;
+    int i;
+
+    task_nr = argc > 3 ? atoi(argv[3]) : 200000;
+    total   = (unsigned long)prod_nr * task_nr;
+
+#if defined(POOL_BENCH_OLD)
+    pool = pool_create(thread_nr);
+#else
+    pool = pool_create(thread_nr, 0, POOL_BLOCK, 0, NULL);
+#endif
+    tids = calloc(prod_nr, sizeof(pthread_t));
+    if (pool == NULL || tids == NULL) 
+        return EXIT_FAILURE;
+
+    t0 = bench_now();
+    for (i = 0; i < prod_nr; i++) 
+        pthread_create(&tids[i], NULL, bench_producer, NULL);
+    for (i = 0; i < prod_nr; i++) 
+        pthread_join(tids[i], NULL);
+    while (done_cnt < total) 
+        sched_yield();
+    t1 = bench_now();
+
+    printf("%d producers, %d threads, %lu tasks: %.3f s, %.0f tasks/s\n",
+           prod_nr, thread_nr, total, t1 - t0, total / (t1 - t0));
+    pool_free(pool);
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * 统计wcamsrv中网络相关系统调用的次数, 与wcamsrv的源文件一起编译,
+ * 链接时用--wrap把这些函数换成这里的计数版本, 见Makefile中的bench/wcamsrv_sysc.
+ *
+ * 收到SIGUSR1时打印各调用的次数并清零, bench/net_bench -p指定服务器进程时
+ * 在测试开始和结束时各发送一次, 打印的就是测试期间的次数
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+enum {
+    SC_EPOLL_WAIT,
+    SC_READ,
+    SC_RECV,
+    SC_ACCEPT,
+    SC_ACCEPT4,
+    SC_FCNTL,
+    SC_WRITE,
+    SC_SEND,
+    SC_SENDMSG,
+    SC_WRITEV,
+    SC_NR,
+};
+
+static const char *sc_names[SC_NR] = {
+    "epoll_wait", "read", "recv", "accept", "accept4",
+    "fcntl", "write", "send", "sendmsg", "writev",
+};
+
+static unsigned long sc_cnt[SC_NR];
+
+#define SC_INC(n)   __sync_add_and_fetch(&sc_cnt[n], 1)
+
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_recv(int sock, void *buf, size_t len, int flags);
+int __real_accept(int sock, struct sockaddr *addr, socklen_t *len);
+int __real_accept4(int sock, struct sockaddr *addr, socklen_t *len, int flags);
+int __real_fcntl(int fd, int cmd, ...);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_send(int sock, const void *buf, size_t len, int flags);
+ssize_t __real_sendmsg(int sock, const struct msghdr *msg, int flags);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    SC_INC(SC_EPOLL_WAIT);
+    return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+    SC_INC(SC_READ);
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_recv(int sock, void *buf, size_t len, int flags)
+{
+    SC_INC(SC_RECV);
+    return __real_recv(sock, buf, len, flags);
+}
+
+int __wrap_accept(int sock, struct sockaddr *addr, socklen_t *len)
+{
+    SC_INC(SC_ACCEPT);
+    return __real_accept(sock, addr, len);
+}
+
+int __wrap_accept4(int sock, struct sockaddr *addr, socklen_t *len, int flags)
+{
+    SC_INC(SC_ACCEPT4);
+    return __real_accept4(sock, addr, len, flags);
+}
+
+/* 只有整数参数的fcntl命令 */
+int __wrap_fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    long arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, long);
+    va_end(ap);
+    SC_INC(SC_FCNTL);
+    return __real_fcntl(fd, cmd, arg);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+    SC_INC(SC_WRITE);
+    return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_send(int sock, const void *buf, size_t len, int flags)
+{
+    SC_INC(SC_SEND);
+    return __real_send(sock, buf, len, flags);
+}
+
+ssize_t __wrap_sendmsg(int sock, const struct msghdr *msg, int flags)
+{
+    SC_INC(SC_SENDMSG);
+    return __real_sendmsg(sock, msg, flags);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    SC_INC(SC_WRITEV);
+    return __real_writev(fd, iov, iovcnt);
+}
+
+static void *sc_dump_thread(void *arg)
+{
+    sigset_t *set = arg;
+    unsigned long n, total;
+    int i, sig;
+
+    for (;;) {
+        if (sigwait(set, &sig))
+            continue;
+        total = 0;
+        for (i = 0; i < SC_NR; i++) {
+            n = __sync_lock_test_and_set(&sc_cnt[i], 0);
+            if (n)
+                fprintf(stderr, "sysc: %-10s %lu\n", sc_names[i], n);
+            total += n;
+        }
+        fprintf(stderr, "sysc: %-10s %lu\n", "total", total);
+    }
+    return NULL;
+}
+
+/*
+ * 在main之前屏蔽SIGUSR1, 之后创建的线程都继承, 只由打印线程sigwait接收
+ */
+__attribute__((constructor)) static void sc_init(void)
+{
+    static sigset_t set;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&tid, NULL, sc_dump_thread, &set))
+        perror("sysc: pthread_create");
+    else
+        pthread_detach(tid);
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <cam/bufpool.h>
+
+#if defined(DBG_BUFP)
+#define pr_debug(fmt, ...) \
+    printf("[%s][%d]" fmt, __func__, __LINE__, ##__VA_ARGS__)
+#else
+#define pr_debug(fmt, ...) \
+    do {} while(0)
+#endif
+
+/* 
+ * 缓冲区头, 位于返回给使用者的指针之前
+ */
+struct bufp_hdr {
+    struct bufp_hdr     *next;          /* 空闲链表 */
+    int                 ref;            /* 引用计数 */
+    int                 cls;            /* 所属级别, -1表示超过最大级别直接malloc */
+    int                 size;           /* 可用大小 */
+} __attribute__((aligned(8)));
+
+struct bufp_class {
+    pthread_mutex_t     mutex;
+    struct bufp_hdr     *free_list;
+    int                 free_nr;
+};
+
+static struct bufp_class bufp_classes[BUFP_CLASS_NR] = {
+    [0 ... BUFP_CLASS_NR - 1] = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    },
+};
+
+static inline int bufp_class_size(int cls)
+{
+    return 1 << (BUFP_MIN_SHIFT + cls);
+}
+
+static inline int bufp_size2class(int size)
+{
+    int cls = 0;
+    while (cls < BUFP_CLASS_NR && bufp_class_size(cls) < size)
+        cls++;
+    return cls < BUFP_CLASS_NR ? cls : -1;
+}
+
+static inline struct bufp_hdr *bufp_hdr(void *buf)
+{
+    return (struct bufp_hdr *)buf - 1;
+}
+
+/*
+ * 分配至少size字节的缓冲区, 引用计数为1
+ */
+void *bufp_alloc(int size)
+{
+    struct bufp_class *c;
+    struct bufp_hdr *h = NULL;
+    int cls = bufp_size2class(size);
+
+    if (cls >= 0) {
+        c = &bufp_classes[cls];
+        pthread_mutex_lock(&c->mutex);
+        h = c->free_list;
+        if (h) {
+            c->free_list = h->next;
+            c->free_nr--;
+        }
+        pthread_mutex_unlock(&c->mutex);
+        size = bufp_class_size(cls);
+    }
+
+    if (!h) {
+        h = malloc(sizeof(struct bufp_hdr) + size);
+        if (!h) {
+            perror("bufp_alloc");
+            return NULL;
+        }
+        h->cls  = cls;
+        h->size = size;
+        pr_debug("new buffer: class = %d, size = %d\n", cls, size);
+    }
+
+    h->ref = 1;
+    return h + 1;
+}
+
+void *bufp_get(void *buf)
+{
+    __sync_add_and_fetch(&bufp_hdr(buf)->ref, 1);
+    return buf;
+}
+
+void bufp_put(void *buf)
+{
+    struct bufp_hdr *h = bufp_hdr(buf);
+    struct bufp_class *c;
+
+    if (__sync_sub_and_fetch(&h->ref, 1) != 0)
+        return;
+
+    if (h->cls < 0) {
+        free(h);
+        return;
+    }
+
+    c = &bufp_classes[h->cls];
+    pthread_mutex_lock(&c->mutex);
+    if ((c->free_nr + 1) * bufp_class_size(h->cls) <= BUFP_KEEP_BYTES) {
+        h->next = c->free_list;
+        c->free_list = h;
+        c->free_nr++;
+        h = NULL;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    free(h);
+}
+
+/*
+ * 缓冲区的实际可用大小
+ */
+int bufp_size(void *buf)
+{
+    return bufp_hdr(buf)->size;
+}
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
 
 #include <cam/utils.h>
 #include <cam/tcp_srv.h>
@@ -34,15 +35,18 @@ struct cfg {
     /* tcp srv  */
     int srv_port;
     int cli_timeout;
-    int cli_timeout_check;
+    int listen_backlog;
+    int listen_reuseport;
 
     /* app */
     int max_app_event;
+    int app_in_group;
 
     /* v4l2 */
     char *camdev;
     int cam_fmt_nr;
     int cam_frm_nr;
+    int cam_fps;
 
     /* fb display */
     int fb_bpp;
@@ -50,6 +54,12 @@ struct cfg {
     int fb_height;
 
     int thread_in_pool;
+    int pool_queue_len;
+    int pool_policy;
+    int pool_stack_size;
+
+    /* 各类线程的CPU绑定和调度策略 */
+    struct thread_sched sched[THREAD_CLASS_NR];
 };
 
 static char cfg_def_version[MAX_LINE_LEN] = {DEF_VERSION};
@@ -59,18 +69,92 @@ static struct cfg def_cfg = {
 	.version = cfg_def_version,
 	.srv_port = DEF_SRV_PORT,
 	.cli_timeout = DEF_TIMEOUT,
-	.cli_timeout_check = DEF_TIMEOUT_CHECK_PER_S,
+	.listen_backlog = DEF_LISTEN_BACKLOG,
 	.max_app_event = DEF_MAX_EVENT,
+	.app_in_group = DEF_APP_IN_GROUP,
 	.camdev = cfg_def_camdev,
     .fb_bpp = DEF_FB_BPP,
     .fb_width = DEF_FB_WIDTH,
     .fb_height = DEF_FB_HEIGHT,
     .thread_in_pool = DEF_THREAD_IN_POOL,
+    .pool_queue_len = DEF_POOL_QUEUE_LEN,
+    .pool_policy = DEF_POOL_POLICY,
+    .pool_stack_size = DEF_POOL_STACK_SIZE,
     .cam_fmt_nr = 0,
     .cam_frm_nr = 0,
+    .cam_fps = 0,
 	//...
 };
 
+static const char *thread_class_name[THREAD_CLASS_NR] = {
+    [THREAD_REACTOR] = "reactor",
+    [THREAD_CAPTURE] = "capture",
+    [THREAD_ENCODER] = "encoder",
+    [THREAD_POOL]    = "pool",
+};
+
+/*
+ * CPU列表, 如"0,2-3", 转换为位图
+ */
+static unsigned long parse_cpus(char *val)
+{
+    unsigned long cpus = 0;
+    char *p = val, *end;
+    long first, last;
+
+    while (*p) {
+        first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (; first <= last && first < sizeof(cpus) * 8; first++)
+            cpus |= 1UL << first;
+        p = end;
+        while (*p == ',' || *p == ' ')
+            p++;
+    }
+    return cpus;
+}
+
+/*
+ * 调度策略, 如"fifo:50", "rr:10", "other:-5"(nice值)
+ */
+static void parse_sched(char *val, struct thread_sched *ts)
+{
+    char *p = strchr(val, ':');
+
+    if (!strncmp(val, "fifo", 4))
+        ts->policy = SCHED_FIFO;
+    else if (!strncmp(val, "rr", 2))
+        ts->policy = SCHED_RR;
+    else
+        ts->policy = SCHED_OTHER;
+    ts->prio = p ? atoi(p + 1) : 0;
+}
+
+static void parse_thread_sched(struct cfg *c, char *arg, char *val)
+{
+    char name[MAX_LINE_LEN];
+    int i;
+
+    for (i = 0; i < THREAD_CLASS_NR; i++) {
+        sprintf(name, "%s_cpus", thread_class_name[i]);
+        if (!strcmp(arg, name)) {
+            c->sched[i].cpus = parse_cpus(val);
+            return;
+        }
+        sprintf(name, "%s_sched", thread_class_name[i]);
+        if (!strcmp(arg, name)) {
+            parse_sched(val, &c->sched[i]);
+            return;
+        }
+    }
+}
+
 static int parse_cfg(cfg_t jcfg) 
 {    
     struct cfg *c = jcfg;
@@ -106,10 +190,14 @@ static int parse_cfg(cfg_t jcfg)
             c->srv_port = atoi(val); 
         } else if(!(strcmp(arg, "cli_timeout"))) {
             c->cli_timeout = atoi(val); 
-        } else if(!(strcmp(arg, "cli_timeout_check"))) {
-            c->cli_timeout_check = atoi(val); 
+        } else if(!(strcmp(arg, "listen_backlog"))) {
+            c->listen_backlog = atoi(val); 
+        } else if(!(strcmp(arg, "listen_reuseport"))) {
+            c->listen_reuseport = atoi(val); 
         } else if(!(strcmp(arg, "max_app_event"))) {
             c->max_app_event = atoi(val); 
+        } else if(!(strcmp(arg, "app_in_group"))) {
+            c->app_in_group = atoi(val); 
         } else if(!(strcmp(arg, "camdev"))) {
             strcpy(c->camdev, val); 
         } else if(!(strcmp(arg, "fb_bpp"))) {
@@ -120,10 +208,27 @@ static int parse_cfg(cfg_t jcfg)
             c->fb_height = atoi(val); 
         } else if(!(strcmp(arg, "thread_in_pool"))) {
             c->thread_in_pool = atoi(val); 
+        } else if(!(strcmp(arg, "pool_queue_len"))) {
+            c->pool_queue_len = atoi(val); 
+        } else if(!(strcmp(arg, "pool_policy"))) {
+            if (!strcmp(val, "block"))
+                c->pool_policy = POOL_BLOCK;
+            else if (!strcmp(val, "reject"))
+                c->pool_policy = POOL_REJECT;
+            else if (!strcmp(val, "drop_oldest"))
+                c->pool_policy = POOL_DROP_OLDEST;
+            else
+                fprintf(stderr, "parse_cfg: unknown pool_policy %s\n", val);
         } else if(!(strcmp(arg, "cam_fmt_nr"))) {
             c->cam_fmt_nr = atoi(val); 
         } else if(!(strcmp(arg, "cam_frm_nr"))) {
             c->cam_frm_nr = atoi(val); 
+        } else if(!(strcmp(arg, "cam_fps"))) {
+            c->cam_fps = atoi(val); 
+        } else if(!(strcmp(arg, "pool_stack_size"))) {
+            c->pool_stack_size = atoi(val) * 1024; 
+        } else {
+            parse_thread_sched(c, arg, val);
         }
     }
 #if defined(DBG_CFG)
@@ -131,27 +236,39 @@ static int parse_cfg(cfg_t jcfg)
              "version = %s\n"
              "srv_port = %d\n"
              "cli_timeout = %d\n"
-             "cli_timeout_check = %d\n"
+             "listen_backlog = %d\n"
+             "listen_reuseport = %d\n"
              "max_app_event = %d\n"
+             "app_in_group = %d\n"
              "camdev = %s\n"
              "fb_bpp = %d\n"
              "fb_width = %d\n"
              "fb_height = %d\n"
              "thread_in_pool = %d\n"
+             "pool_queue_len = %d\n"
+             "pool_policy = %d\n"
+             "pool_stack_size = %d\n"
              "cam_fmt_nr = %d\n"
-             "cam_frm_nr = %d\n",
+             "cam_frm_nr = %d\n"
+             "cam_fps = %d\n",
              c->version,
              c->srv_port,
              c->cli_timeout,
-             c->cli_timeout_check,
+             c->listen_backlog,
+             c->listen_reuseport,
              c->max_app_event,
+             c->app_in_group,
              c->camdev,
              c->fb_bpp,
              c->fb_width,
              c->fb_height,
              c->thread_in_pool,
+             c->pool_queue_len,
+             c->pool_policy,
+             c->pool_stack_size,
              c->cam_fmt_nr,
-             c->cam_frm_nr);
+             c->cam_frm_nr,
+             c->cam_fps);
 #endif
     return 0;
 }
@@ -193,10 +310,16 @@ int cfg_get_cli_timeout(cfg_t cfg)
 	return c->cli_timeout;
 }
 
-int cfg_get_cli_timeout_check(cfg_t cfg)
+int cfg_get_listen_backlog(cfg_t cfg)
 {
     struct cfg *c = cfg;
-	return c->cli_timeout_check;
+	return c->listen_backlog;
+}
+
+int cfg_get_listen_reuseport(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->listen_reuseport;
 }
 
 int cfg_get_max_app_event(cfg_t cfg)
@@ -205,6 +328,12 @@ int cfg_get_max_app_event(cfg_t cfg)
 	return c->max_app_event;
 }
 
+int cfg_get_app_in_group(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->app_in_group;
+}
+
 char *cfg_get_camdev(cfg_t cfg)
 {
     struct cfg *c = cfg;
@@ -223,6 +352,12 @@ int cfg_get_cam_frm_nr(cfg_t cfg)
 	return c->cam_frm_nr;
 }
 
+int cfg_get_cam_fps(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->cam_fps;
+}
+
 int cfg_get_fb_bpp(cfg_t cfg)
 {
     struct cfg *c = cfg;
@@ -247,6 +382,30 @@ int cfg_get_thread_in_pool(cfg_t cfg)
 	return c->thread_in_pool;
 }
 
+int cfg_get_pool_queue_len(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->pool_queue_len;
+}
+
+int cfg_get_pool_policy(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->pool_policy;
+}
+
+int cfg_get_pool_stack_size(cfg_t cfg)
+{
+    struct cfg *c = cfg;
+	return c->pool_stack_size;
+}
+
+const struct thread_sched *cfg_get_thread_sched(cfg_t cfg, int cls)
+{
+    struct cfg *c = cfg;
+	return &c->sched[cls];
+}
+
 char *cfg_get_version(cfg_t cfg)
 {
     struct cfg *c = cfg;
@@ -244,7 +244,7 @@ int fbd_show_yuv_frame(fbd_t fb, const void *yuv_frm, int w, int h)
 
 jpg_dec_t d;
 
-void img_proc(const void *p, int size, void *arg)
+int img_proc(const void *p, int size, void *arg)
 {
     fbd_t f = arg;
     int w, h; 
@@ -255,6 +255,7 @@ void img_proc(const void *p, int size, void *arg)
 
     fprintf(stdout, ".");
     fflush(stdout);
+    return V4L2_BUF_DONE;
 }
 
 int main(int argc, char *argv[])
@@ -1,20 +1,39 @@
 #ifndef	__APP_H__
 	#define __APP_H__
 
+#include <cam/list.h>
+
 typedef struct app_event *app_event_t;
 typedef struct app *app_t;
+typedef struct app_group *app_group_t;
+
+struct thread_sched;
 
 enum app_notifier_t {
     NOTIFIER_READ  = 0,
     NOTIFIER_WRITE = 1,
     NOTIFIER_ERROR = 2,
+    NOTIFIER_PRI   = 3,     /* 带外或优先数据, 如V4L2事件 */
+
+    NOTIFIER_EDGE  = 0x10,  /* 与以上类型按位或, 以边沿触发方式注册 */
 };
 
 #define DEF_MAX_EVENT 	512
+#define DEF_APP_IN_GROUP 1
+#define APP_TIMER_TICK_MS   100     /* 定时器精度 */
+
+/* 
+ * 定时器, 嵌入到使用者的结构中, 超时处理函数在app的线程中调用
+ */
+struct app_timer {
+    struct list_head entry;
+    unsigned long expires;          /* 超时的tick */
+    void (*handler)(struct app_timer *);
+};
 
 app_event_t app_event_create(int fd);
 void app_event_add_notifier(app_event_t ev, 
-                            enum app_notifier_t type, 
+                            int type, 
                             void (*handler)(int, void *), 
                             void *arg);
 void app_event_free(app_event_t ev);
@@ -22,9 +41,26 @@ void app_event_free(app_event_t ev);
 app_t app_create(int event_max);
 void app_free(app_t app);
 int app_exec(app_t app);
+void app_finish(app_t app);
+void app_set_sched(app_t app, const struct thread_sched *ts);
 int app_add_event(app_t app, app_event_t ev);
 int app_del_event(app_t app, app_event_t ev);
+int app_mod_event(app_t app, app_event_t ev, bool rd, bool wr);
+
+void app_timer_init(struct app_timer *t, void (*handler)(struct app_timer *));
+int app_timer_mod(app_t app, struct app_timer *t, int ms);
+void app_timer_del(app_t app, struct app_timer *t);
+unsigned long app_timer_now(app_t app);
 
 bool app_event_epolled(app_event_t ev);
+int app_get_event_cnt(app_t app);
+
+app_group_t app_group_create(int app_nr, int event_max);
+void app_group_free(app_group_t grp);
+int app_group_exec(app_group_t grp);
+void app_group_finish(app_group_t grp);
+int app_group_get_nr(app_group_t grp);
+app_t app_group_get(app_group_t grp, int idx);
+app_t app_group_pick(app_group_t grp);
 
 #endif	//__APP_H__
@@ -0,0 +1,18 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+/*
+ * 按大小分级的共享缓冲区池, 缓冲区带引用计数, 
+ * 引用计数为0时放回对应级别的空闲链表
+ */
+
+#define BUFP_MIN_SHIFT      8           /* 最小一级256字节 */
+#define BUFP_CLASS_NR       13          /* 最大一级1MB */
+#define BUFP_KEEP_BYTES     0x200000    /* 每级空闲链表最多保留2MB */
+
+void *bufp_alloc(int size);
+void *bufp_get(void *buf);
+void bufp_put(void *buf);
+int bufp_size(void *buf);
+
+#endif
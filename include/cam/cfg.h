@@ -3,6 +3,17 @@
 
 typedef struct cfg *cfg_t;
 
+/* 可以单独设置CPU绑定和调度策略的线程类别 */
+enum thread_class {
+    THREAD_REACTOR = 0,             /* 事件循环线程 */
+    THREAD_CAPTURE,                 /* 采集线程, 即第一个事件循环线程 */
+    THREAD_ENCODER,                 /* YUYV编码线程 */
+    THREAD_POOL,                    /* 线程池中的线程 */
+    THREAD_CLASS_NR,
+};
+
+struct thread_sched;
+
 cfg_t cfg_create(char *cfg_path);
 void cfg_free(cfg_t cfg);
 
@@ -10,18 +21,25 @@ char *cfg_get_version(cfg_t cfg);
 
 int cfg_get_srvport(cfg_t cfg);
 int cfg_get_cli_timeout(cfg_t cfg);
-int cfg_get_cli_timeout_check(cfg_t cfg);
+int cfg_get_listen_backlog(cfg_t cfg);
+int cfg_get_listen_reuseport(cfg_t cfg);
 int cfg_get_max_app_event(cfg_t cfg);
+int cfg_get_app_in_group(cfg_t cfg);
 
 char *cfg_get_camdev(cfg_t cfg);
 int cfg_get_cam_fmt_nr(cfg_t cfg);
 int cfg_get_cam_frm_nr(cfg_t cfg);
+int cfg_get_cam_fps(cfg_t cfg);
 
 int cfg_get_fb_bpp(cfg_t cfg);
 int cfg_get_fb_width(cfg_t cfg);
 int cfg_get_fb_height(cfg_t cfg);
 
 int cfg_get_thread_in_pool(cfg_t cfg);
+int cfg_get_pool_queue_len(cfg_t cfg);
+int cfg_get_pool_policy(cfg_t cfg);
+int cfg_get_pool_stack_size(cfg_t cfg);
+const struct thread_sched *cfg_get_thread_sched(cfg_t cfg, int cls);
 
 #define MAX_LINE_LEN 	256
 #define DEF_CFG_PATH 	"/root/wcamsrv/config"
@@ -10,6 +10,17 @@
  * 命令: 帧命令.
  * 数据: 帧数据.
  * 
+ * 扩展帧格式如下, 连接通过SYS_SET_PROTO协商使用协议版本PROTO_VER_EXT后, 
+ * 服务器发出的帧都使用扩展帧格式, 客户端可以发送通用帧或扩展帧.
+ * 字节:
+ * 1    | 2    | 4    | 4    | 0-长度
+ * 0xFF | 命令 | 长度 | 序号 | 数据
+ * 
+ * 长度: 4字节的数据字段长度, 字节序与数据中的整数相同. 
+ * 序号: 请求的序号由客户端指定, 同步应答带回对应请求的序号, 
+ *       服务器主动发送的异步请求使用该连接上递增的序号.
+ * 通用帧的长度不超过FRAME_DAT_MAX, 所以0xFF不会与通用帧冲突.
+ * 
  * 命令字段由cmd0和cmd1两字节构成, 格式如下: 
  * Cmd0 | Cmd1
  * Bits:
@@ -33,12 +44,24 @@
 #ifndef __PROTOCAL_H__
 #define __PROTOCAL_H__
 
-    #define FRAME_MAX_SZ    253
+    #define FRAME_MAX_SZ    (FRAME_HDR_SZ + 0xFF)
     #define FRAME_DAT_MAX   253
     #define FRAME_HDR_SZ    3
 
     #define FRAME_ERR_SZ    3
 
+    /* 扩展帧 */
+    #define FRAME_EXT_LEN       0xFF    /* 长度字段为此值时是扩展帧 */
+    #define FRAME_EXT_HDR_SZ    11
+    #define EXT_LEN_POS         3
+    #define EXT_SEQ_POS         7
+    #define EXT_DAT_POS         11
+
+    /* 协议版本 */
+    #define PROTO_VER_BASE      1       /* 只使用通用帧 */
+    #define PROTO_VER_EXT       2       /* 服务器发出扩展帧 */
+    #define PROTO_VER_MAX       PROTO_VER_EXT
+
     #define TYPE_MASK       0xE0
     #define TYPE_BIT_POS    5
     #define SUBS_MASK       0x1F
@@ -6,6 +6,8 @@
 enum request {
 
 	SYS_VERSION		=	REQUEST(0x0, TYPE_SREQ, SUBS_SYS, 0x0),
+	SYS_SET_PROTO	=	REQUEST(0x1, TYPE_SREQ, SUBS_SYS, 0x1),
+	SYS_POOL_STATS	=	REQUEST(0x0, TYPE_SREQ, SUBS_SYS, 0x2),
 
 	/**
 	 * VID SubSystem
@@ -14,13 +16,95 @@ enum request {
 	VID_GET_UCTL	=	REQUEST(0x4, TYPE_SREQ, SUBS_VID, 0x1), 
 	VID_SET_UCTL	=	REQUEST(0x8, TYPE_AREQ, SUBS_VID, 0x2), 
 	VID_SET_UCS2DEF	=	REQUEST(0x0, TYPE_AREQ, SUBS_VID, 0x3), 
+	VID_SET_UCTLS	=	REQUEST(0x0, TYPE_AREQ, SUBS_VID, 0x4), 	/* 变长 */
+	VID_GET_UCTL_MULTI	=	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x5), 	/* 变长 */
+	VID_GET_UCTL_LIST	=	REQUEST(0x4, TYPE_SREQ, SUBS_VID, 0x6), 
+	VID_SET_UCTLS_ACK	=	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x7), 	/* 变长 */
 
 	VID_GET_FRMSIZ	=	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x10), 
 	VID_GET_FMT	    =	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x11), 
+	VID_GET_FMTS	=	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x12), 
+	VID_SET_FMT	    =	REQUEST(0x8, TYPE_AREQ, SUBS_VID, 0x13), 
+	VID_SET_FPS	    =	REQUEST(0x4, TYPE_AREQ, SUBS_VID, 0x14), 
+	VID_GET_FPS	    =	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x15), 
 
 	VID_REQ_FRAME	=	REQUEST(0x0, TYPE_SREQ, SUBS_VID, 0x20),
+	VID_SUBSCRIBE	=	REQUEST(0x2, TYPE_AREQ, SUBS_VID, 0x21),
+	VID_UNSUBSCRIBE	=	REQUEST(0x0, TYPE_AREQ, SUBS_VID, 0x22),
+	VID_PUSH_FRAME	=	REQUEST(0x4, TYPE_AREQ, SUBS_VID, 0x23),	/* 服务器推送 */
+	VID_FMT_CHANGED	=	REQUEST(0x1C, TYPE_AREQ, SUBS_VID, 0x24),	/* 服务器推送 */
 };
 
+/* 
+ * SYS_SET_PROTO的数据: 1字节客户端支持的最高协议版本, 
+ * 应答: 1字节双方使用的协议版本, 应答仍使用协商前的帧格式.
+ * 应在订阅推送前协商
+ */
+
+/* SYS_POOL_STATS的应答, 线程池任务队列的状态和溢出计数 */
+struct sys_pool_stats {
+	__u32	capacity;				/* 最多等待执行的任务数 */
+	__u32	depth;					/* 当前等待执行的任务数 */
+	__u32	dropped;				/* 队列满时被丢弃的任务数 */
+	__u32	rejected;				/* 队列满时被拒绝的任务数 */
+};
+
+/*
+ * VID_SET_UCTLS的数据: n个(4字节id, 4字节值), 在一次ioctl中设置
+ * VID_SET_UCTLS_ACK的数据与VID_SET_UCTLS相同, 应答为struct vid_uctls_ack
+ * VID_GET_UCTL_MULTI的数据: n个4字节id, 
+ * 应答与VID_GET_UCTLS相同, 通用帧在帧头后附加4字节大小, 之后为n个(id, 值)
+ */
+struct vid_uctls_ack {
+	__s32	err;					/* 0表示成功, 否则为驱动返回的errno */
+	__u32	err_idx;				/* 出错的控制项下标, 等于n表示不属于某一项 */
+};
+
+/*
+ * VID_GET_UCTL_LIST的数据: 4字节客户端已有的列表版本, 0表示没有,
+ * 应答与VID_GET_UCTLS相同(通用帧在帧头后附加4字节大小), 数据为
+ * struct vid_uctl_list_hdr, 之后是nr个struct v4l2_uctl_info, 
+ * 菜单控制项之后紧跟其菜单项. 版本与客户端已有的相同时只有列表头, nr为0
+ */
+#define VID_UCTL_LIST_FMT	1		/* 列表格式版本 */
+
+struct vid_uctl_list_hdr {
+	__u32	fmt;					/* VID_UCTL_LIST_FMT */
+	__u32	ver;					/* 列表内容版本, 控制项改变时增加, 0表示不缓存 */
+	__u32	nr;						/* 控制项个数 */
+	__u32	reserved;
+};
+
+/*
+ * VID_GET_FMTS的应答与VID_GET_UCTLS相同(通用帧在帧头后附加4字节大小), 
+ * 数据为各像素格式依次排列: struct v4l2_fmtdesc, 4字节帧大小个数n, 
+ * n个帧大小, 每个帧大小为struct v4l2_frmsizeenum, 4字节帧间隔个数m, 
+ * m个struct v4l2_frmivalenum. 帧间隔不是离散值时只有一项, 其中是范围
+ *
+ * VID_SET_FMT的数据: 4字节像素格式下标, 4字节帧大小下标, 即VID_GET_FMTS列表中的位置.
+ * VID_SET_FPS的数据: 4字节目标帧率, 0表示驱动默认帧率.
+ * 切换在采集线程中进行, 完成后向订阅推送的客户端发送VID_FMT_CHANGED, 
+ * 失败时只向最后一个请求切换的客户端发送, err为失败的errno, 
+ * 其他字段是仍在使用的格式
+ */
+struct vid_fmt_changed {
+	__u32	fmt_nr;
+	__u32	frm_nr;
+	__u32	width;
+	__u32	height;
+	struct v4l2_fract ival;			/* 帧间隔, 驱动不支持时为0/0 */
+	__s32	err;					/* 0表示切换成功 */
+};
+
+/* VID_GET_FPS的应答 */
+struct vid_fps {
+	__u32	fps;					/* 目标帧率 */
+	struct v4l2_fract ival;			/* 驱动实际使用的帧间隔 */
+};
+
+/* VID_SUBSCRIBE的数据: 1字节最大帧率(0表示不限), 1字节标志 */
+#define VID_SUB_LATEST		0x1		/* 上一帧未发送完时丢弃新帧 */
+
 #define REQUEST_ID(req)     (((req) >> (8*CMD1_POS)) & 0xFF)
 #define REQUEST_TYPE(req)   (((req) >> (8*CMD0_POS + TYPE_BIT_POS)) & TYPE_MASK)
 #define REQUEST_SUBS(req)   (((req) >> (8*CMD0_POS)) & SUBS_MASK)
@@ -5,7 +5,7 @@
 
 #define DEF_TCP_SRV_PORT        19868
 #define DEF_TIMEOUT             60
-#define DEF_TIMEOUT_CHECK_PER_S 1
+#define DEF_LISTEN_BACKLOG      128
 
 #include <netinet/in.h>
 
@@ -23,12 +23,18 @@ typedef int (*tcpc_handler_t)(tcpc_t);
 void tcps_set_cli_recvhandler(tcp_srv_t srv, tcpc_handler_t handler);
 void tcps_set_cli_init(tcp_srv_t srv, int (*init)(tcpc_t, void *), void *arg);
 void tcps_set_cli_uninit(tcp_srv_t srv, void (*uninit)(tcpc_t));
+void tcps_set_cli_drainhandler(tcp_srv_t srv, void (*handler)(tcpc_t));
+void tcps_set_cli_apps(tcp_srv_t srv, app_group_t grp);
 void tcps_set_timeout(tcp_srv_t srv, int timeout);
-void tcps_set_timeout_check(tcp_srv_t srv, int per_s);
 
-tcp_srv_t tcps_create(app_t app, int port);
+tcp_srv_t tcps_create(app_t app, int port, int backlog, int reuseport);
 void tcps_free(tcp_srv_t srv);
-void tcpc_send(tcpc_t tc, void *buf, int len);
+int tcpc_send(tcpc_t tc, void *buf, int len);
+int tcpc_send_ref(tcpc_t tc, void *buf, int len, 
+                  void (*release)(void *), void *arg);
+int tcpc_send_hdr_ref(tcpc_t tc, void *hdr, int hdr_len, void *buf, int len, 
+                      void (*release)(void *), void *arg);
+int tcpc_get_tx_len(tcpc_t tc);
 
 #endif
 
@@ -1,15 +1,61 @@
 #ifndef	__THREADPOOL_H__
 #define __THREADPOOL_H__
 	
+#include <cam/app.h>
+
 /* Opaque struct pointer to thread_pool_t */	
 typedef struct thread_pool *thread_pool_t;
+typedef struct pool_task *pool_task_t;
+typedef struct pool_cq *pool_cq_t;
+
+struct thread_sched;
 
 #define DEF_THREAD_IN_POOL   8
+#define DEF_POOL_QUEUE_LEN   256     /* 最多等待执行的任务数 */
+#define DEF_POOL_STACK_SIZE  (512*1024)
+
+/* 任务队列满时的处理方式 */
+enum pool_policy {
+    POOL_BLOCK          = 0,        /* 等待有空位 */
+    POOL_REJECT         = 1,        /* 不加入, 返回-1 */
+    POOL_DROP_OLDEST    = 2,        /* 丢弃最早的任务 */
+};
+#define DEF_POOL_POLICY     POOL_DROP_OLDEST
+
+struct pool_stats {
+    int capacity;
+    int depth;                      /* 等待执行的任务数 */
+    unsigned long dropped;          /* 被丢弃的任务数 */
+    unsigned long rejected;         /* 被拒绝的任务数 */
+};
 
-thread_pool_t pool_create(int thread_nr);
+thread_pool_t pool_create(int thread_nr, int capacity, int policy,
+                          int stack_size, const struct thread_sched *sched);
 int pool_add_worker(thread_pool_t pool, 
                            void *(*process)(void *arg), 
 						   void *arg); 
+void pool_set_drop_handler(thread_pool_t pool, 
+                           void (*drop)(void *(*process)(void *), void *arg));
+void pool_get_stats(thread_pool_t pool, struct pool_stats *st);
+
+/* 任务状态 */
+enum pool_task_state {
+    POOL_TASK_PENDING   = 0,
+    POOL_TASK_DONE      = 1,
+    POOL_TASK_DROPPED   = 2,        /* 队列满时被丢弃, 没有执行 */
+};
+
+pool_task_t pool_submit(thread_pool_t pool, void *(*process)(void *), void *arg);
+int pool_submit_cq(thread_pool_t pool, pool_cq_t cq, 
+                   void *(*process)(void *), void *arg,
+                   void (*done)(pool_task_t, void *), void *done_arg);
+void pool_task_then(pool_task_t task, void (*then)(pool_task_t, void *), void *arg);
+int pool_task_poll(pool_task_t task, void **ret);
+int pool_task_wait(pool_task_t task, void **ret);
+void pool_task_put(pool_task_t task);
+
+pool_cq_t pool_cq_create(app_t app);
+void pool_cq_free(pool_cq_t cq);
 int pool_free(thread_pool_t pool);
 
 #endif	//__THREADPOOL_H__
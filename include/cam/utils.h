@@ -26,9 +26,16 @@ static inline int xioctl(int fd, int request, void *arg)
 	return r;
 }
 
-#define LISTEN_QUEUE_LEN  5	
+/* 线程的CPU绑定和调度策略 */
+struct thread_sched {
+    unsigned long   cpus;           /* 绑定的CPU位图, 0表示不绑定 */
+    int             policy;         /* SCHED_OTHER, SCHED_FIFO 或 SCHED_RR */
+    int             prio;           /* 实时优先级, SCHED_OTHER时为nice值 */
+};
 
-int tcp_srv_sock(int port);
+int thread_set_sched(const struct thread_sched *ts);
+
+int tcp_srv_sock(int port, int backlog, int reuseport);
 int tcp_cli_sock(char *ip, int port);
 int setnonblocking(int sfd);
 
@@ -6,13 +6,21 @@
 #define DEF_V4L_DEV  		"/dev/video0"
 
 typedef struct v4l2_dev *v4l2_dev_t;
-typedef void (*v4l2_img_proc_t)(const void *p, int size, void *arg);
+/* 
+ * 图像处理回调, 返回V4L2_BUF_DONE时缓冲区马上送回驱动,
+ * 返回V4L2_BUF_HOLD时缓冲区由回调持有, 处理完后调用v4l2_put_buf送回
+ */
+typedef int (*v4l2_img_proc_t)(const void *p, int size, void *arg);
 
-//采集缓冲队列长度
-#define NR_REQBUF 4 
+#define V4L2_BUF_DONE   0
+#define V4L2_BUF_HOLD   1
+
+//采集缓冲队列长度, MJPEG帧发送完前一直持有采集缓冲区, 所以多申请一些
+#define NR_REQBUF 8 
 
 #define MAX_FMT_TYPE_NR     128
 #define MAX_FRM_SIZ_NR      32
+#define MAX_FRM_IVAL_NR     32
 
 #include <linux/types.h>
 #include <linux/videodev2.h>
@@ -27,29 +35,73 @@ struct v4l2_uctl {
 	__u8                 name[32];      /* 名控制项称 */
 };
 
-struct v4l2_uctls {
-    __u32 nr;
-    struct v4l2_uctl list[];
+/* 
+ * 完整的控制项信息, 包括所有类的控制项和菜单控制项, 
+ * 菜单控制项之后紧跟menu_nr个struct v4l2_uctl_menu.
+ * 结构大小都是8的倍数, 连续排列时各字段都能对齐
+ */
+struct v4l2_uctl_info {
+	__u32                id;            /* 控制项id */
+	__u32                type;          /* enum v4l2_ctrl_type */
+	__s32                val;           /* 当前值 */
+	__s32                def_val;       /* 默认值 */
+	__s32                min;           /* 最小值 */
+	__s32                max;           /* 最大值 */
+	__s32                step;          /* 步长 */
+	__u32                flags;         /* V4L2_CTRL_FLAG_xxx */
+	__u32                menu_nr;       /* 菜单项个数 */
+	__u32                reserved;
+	__u8                 name[32];      /* 控制项名称 */
+};
+
+struct v4l2_uctl_menu {
+	__u32                index;         /* 菜单项的值 */
+	__u32                reserved;
+	__s64                value;         /* 整数菜单项的值 */
+	__u8                 name[32];      /* 菜单项名称 */
+};
+
+/* 控制项id和值, 用于一次读取或设置多个控制项 */
+struct v4l2_uctl_val {
+    __u32                id;
+    __s32                val;
 };
 
 int v4l2_set_uctl(v4l2_dev_t vd, __u32 id, __s32 val);
 int v4l2_set_uctls2def(v4l2_dev_t vd);
 
+int v4l2_set_uctl_multi(v4l2_dev_t vd, const struct v4l2_uctl_val *vals, 
+                        __u32 nr, __u32 *err_idx);
+
 __s32 v4l2_get_uctl(v4l2_dev_t vd, __u32 id, bool *ok);
+int v4l2_get_uctl_multi(v4l2_dev_t vd, struct v4l2_uctl_val *vals, __u32 nr);
 void v4l2_get_uctls(v4l2_dev_t vd, struct v4l2_uctl *uctls);
 __u32 v4l2_get_uctls_nr(v4l2_dev_t vd);
+__u32 v4l2_get_uctls_ver(v4l2_dev_t vd);
+__u32 v4l2_get_uctl_infos_size(v4l2_dev_t vd, __u32 *nr);
+void v4l2_get_uctl_infos(v4l2_dev_t vd, void *buf);
 
 int v4l2_set_fmt(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr);
+int v4l2_switch_fmt(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr);
 __u32 v4l2_get_fmts_nr(v4l2_dev_t vd);
 __u32 v4l2_get_fmt_frms_nr(v4l2_dev_t vd, __u32 fmt_nr);
 int v4l2_get_fmt(v4l2_dev_t vd, __u32 fmt_nr, struct v4l2_fmtdesc *fmt);
 int v4l2_get_frmsize(v4l2_dev_t vd, 
                      __u32 fmt_nr, __u32 frm_nr, 
                      struct v4l2_frmsizeenum *frm);
+__u32 v4l2_get_frm_ivals_nr(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr);
+int v4l2_get_frm_ival(v4l2_dev_t vd, 
+                      __u32 fmt_nr, __u32 frm_nr, __u32 ival_nr,
+                      struct v4l2_frmivalenum *ival);
+int v4l2_set_fps(v4l2_dev_t vd, __u32 fps);
+__u32 v4l2_get_fps(v4l2_dev_t vd, struct v4l2_fract *ival);
+__u32 v4l2_get_buf_nr(v4l2_dev_t vd, __u32 *held);
+__u32 v4l2_get_busy_buf_nr(v4l2_dev_t vd);
 __u32 v4l2_get_cur_fmt_nr(v4l2_dev_t vd);
 __u32 v4l2_get_cur_frm_nr(v4l2_dev_t vd);
 
 v4l2_img_proc_t v4l2_set_img_proc(v4l2_dev_t vd, v4l2_img_proc_t proc, void *arg);
+void v4l2_put_buf(v4l2_dev_t vd, const void *p);
 int v4l2_start_capture(v4l2_dev_t vd);
 int v4l2_stop_capture(v4l2_dev_t vd);
 
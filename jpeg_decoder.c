@@ -131,7 +131,7 @@ void jpg_dec_get_frmsiz(jpg_dec_t dec, int *w, int *h)
 #include <cam/v4l2.h>
 #include <cam/app.h>
 
-void img_proc(const void *p, int size, void *arg)
+int img_proc(const void *p, int size, void *arg)
 {
     jpg_dec_t d = arg;
     static int i;
@@ -146,6 +146,7 @@ void img_proc(const void *p, int size, void *arg)
     fclose(fp);
     fprintf(stdout, ".");
     fflush(stdout);
+    return V4L2_BUF_DONE;
 }
 
 int main(int argc, char *argv[])
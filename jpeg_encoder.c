@@ -138,7 +138,7 @@ void *jpg_enc_get_outbuf(jpg_enc_t enc, int *len)
 #include <cam/v4l2.h>
 #include <cam/app.h>
 
-void img_proc(const void *p, int size, void *arg)
+int img_proc(const void *p, int size, void *arg)
 {
     jpg_enc_t enc = arg;
     static int i;
@@ -152,6 +152,7 @@ void img_proc(const void *p, int size, void *arg)
     fclose(fp);
     fprintf(stdout, ".");
     fflush(stdout);
+    return V4L2_BUF_DONE;
 }
 
 int main(int argc, char *argv[])
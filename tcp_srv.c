@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,12 +8,14 @@
 #include <time.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 
 #include <cam/list.h>
 #include <cam/utils.h>
+#include <cam/bufpool.h>
 #include <cam/tcp_srv.h>
 
 #if defined(DBG_TCP)
@@ -23,160 +26,462 @@
     do {} while(0)
 #endif
 
+#define TCPC_IOV_MAX            16              /* 一次sendmsg最多发送的段数 */
+#define TCPC_TX_HIGH            (64*1024)       /* 发送队列超过此值时暂停处理请求 */
+#define TCPS_ACCEPT_RETRY_MS    100             /* 描述符用完且无备用描述符时重试接受的间隔 */
+
+/* 
+ * 发送队列中的一段数据, 从缓冲区池中分配, 只在发送期间占用
+ */
+struct tcpc_seg {
+    struct iovec            iov;            /* 未发送部分 */
+    void                    (*release)(void *arg); /* 发送完或连接释放时调用 */
+    void                    *arg;
+	struct list_head        entry;     
+    char                    data[];         /* tcpc_send复制的数据 */
+};
+
 struct tcp_cli {
     int                     sock;           /* 客户端套结字 */
     struct sockaddr_in      addr;           /* 客户端网络地址 */
     void                    *arg;           /* 客户端私有数据初始化函数 */
 
-    app_event_t             ev_rx;          /* 客户端读事件 */
-    app_event_t             ev_tx;          /* 客户端写事件 */
+    app_event_t             ev;             /* 客户端读写事件 */
 
-    char                    *buf;           /* buf to send */
-    int                     len;            /* buf length */
+	struct list_head        tx_queue;       /* 发送队列 */
+    int                     tx_len;         /* 发送队列中未发送的字节数 */
+    bool                    in_rx;          /* 正在处理请求, 应答暂不发送 */
+    pthread_mutex_t         tx_mutex;       /* 其他线程也可能向客户端发送数据 */
 
-    time_t                  last_active;    /* 用于超时处理 */    
+    unsigned long           last_active;    /* 最后活动的tick, 用于超时处理 */    
+    struct app_timer        timer;          /* 超时定时器 */
 	struct list_head        entry;     
 
     struct tcp_srv          *srv;           /* 对应服务器 */
+    app_t                   app;            /* 客户端事件所在的app */
 };
 
 struct tcp_srv {
     int                     sock;           /* 服务器监听套结字 */
-	struct list_head        cli_list;       /* 客户端列表 */
-
-	pthread_t               tid;            /* 用于检查超时的线程 */      
+	struct list_head        cli_list;       /* 客户端列表, 用于释放服务器时释放客户端 */
     pthread_mutex_t         mutex;
-    bool                    need_stop;
-    int                     timeout_check_per_s;  
-    int                     timeout;       
+    int                     timeout;        /* 客户端无请求超时时间, 单位是秒 */
 
     app_t                   app;
+    app_group_t             grp;            /* 非空时客户端分派到组内各app */
     app_event_t             ev;             /* 监听事件 */
+    int                     spare_fd;       /* 备用描述符, 描述符用完时用来接受并关闭连接 */
+    struct app_timer        retry;          /* 没有备用描述符时定时重试接受 */
 
     void                    *arg;           /* 客户端初始化函数传入参数 */
     int  (*init)(tcpc_t, void*);            /* 客户端私有数据初始化函数 */
     void (*uninit)(tcpc_t);                 /* 客户端私有数据反初始化函数 */
 
     tcpc_handler_t          recv_handler;
+    void (*drain_handler)(tcpc_t);          /* 客户端发送队列发送完时调用 */
 };
 
-void tcpc_send(tcpc_t tc, void *buf, int len)
+static void tcpc_seg_free(struct tcpc_seg *seg)
+{
+    list_del(&seg->entry);
+    if (seg->release)
+        seg->release(seg->arg);
+    bufp_put(seg);
+}
+
+/*
+ * 用sendmsg一次发送队列中的多段数据, 直到发完或套接字发送缓冲区已满
+ * 返回0表示正常, -1表示连接出错
+ */
+static int tcpc_flush(struct tcp_cli *c)
+{
+    struct iovec iov[TCPC_IOV_MAX];
+    struct msghdr msg;
+    struct tcpc_seg *seg, *tmp;
+    int res, n;
+
+    while (c->tx_len > 0) {
+        n = 0;
+        list_for_each_entry(seg, &c->tx_queue, entry) {
+            iov[n++] = seg->iov;
+            if (n == TCPC_IOV_MAX)
+                break;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = n;
+        res = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        c->tx_len -= res;
+        list_for_each_entry_safe(seg, tmp, &c->tx_queue, entry) {
+            if (res < seg->iov.iov_len) {
+                seg->iov.iov_base += res;
+                seg->iov.iov_len  -= res;
+                break;
+            }
+            res -= seg->iov.iov_len;
+            tcpc_seg_free(seg);
+        }
+    }
+    return 0;
+}
+
+/*
+ * 发送队列为空时只关注读事件, 否则只关注写事件, 
+ * 直到应答都发送完才继续处理请求
+ */
+static inline void tcpc_update_event(struct tcp_cli *c)
+{
+    app_mod_event(c->app, c->ev, c->tx_len == 0, c->tx_len > 0);
+}
+
+/*
+ * 将seg及next(可以为NULL)连续加入发送队列, 其他线程的数据不会插在两者之间
+ */
+static void tcpc_queue(struct tcp_cli *c, struct tcpc_seg *seg, 
+                       struct tcpc_seg *next)
+{
+    pthread_mutex_lock(&c->tx_mutex);
+    list_add_tail(&seg->entry, &c->tx_queue);
+    c->tx_len += seg->iov.iov_len;
+    if (next) {
+        list_add_tail(&next->entry, &c->tx_queue);
+        c->tx_len += next->iov.iov_len;
+    }
+
+    /* 处理请求时产生的应答在rx_app_handler中一起发送 */
+    if (!c->in_rx) {
+        /* 先直接发送, 发送不完或出错时关注写事件, 由tx_app_handler处理 */
+        if (tcpc_flush(c) == -1)
+            app_mod_event(c->app, c->ev, false, true);
+        else
+            tcpc_update_event(c);
+    }
+    pthread_mutex_unlock(&c->tx_mutex);
+}
+
+/*
+ * 复制数据到发送队列, 调用后buf即可重用
+ * 可以在其他线程中调用, 但不能与客户端的uninit并发
+ */
+int tcpc_send(tcpc_t tc, void *buf, int len)
 {
 	struct tcp_cli *c = (struct tcp_cli*)tc;
-	struct tcp_srv *s = c->srv;
-     
-    app_del_event(s->app, c->ev_rx);
-    c->buf = buf;
-    c->len = len;
-    app_add_event(s->app, c->ev_tx);
+    struct tcpc_seg *seg;
+
+    if (len <= 0)
+        return 0;
+
+    seg = bufp_alloc(sizeof(struct tcpc_seg) + len);
+    if (!seg) 
+        return -1;
+    memcpy(seg->data, buf, len);
+    seg->iov.iov_base = seg->data;
+    seg->iov.iov_len  = len;
+    seg->release      = NULL;
+    seg->arg          = NULL;
+    tcpc_queue(c, seg, NULL);
+    return 0;
+}
+
+/*
+ * 不复制数据, 直接将buf加入发送队列, 
+ * buf发送完或连接释放时调用release(arg), 在此之前buf不能修改
+ */
+int tcpc_send_ref(tcpc_t tc, void *buf, int len, 
+                  void (*release)(void *), void *arg)
+{
+	struct tcp_cli *c = (struct tcp_cli*)tc;
+    struct tcpc_seg *seg;
+
+    if (len <= 0) {
+        if (release)
+            release(arg);
+        return 0;
+    }
+
+    seg = bufp_alloc(sizeof(struct tcpc_seg));
+    if (!seg) {
+        if (release)
+            release(arg);
+        return -1;
+    }
+    seg->iov.iov_base = buf;
+    seg->iov.iov_len  = len;
+    seg->release      = release;
+    seg->arg          = arg;
+    tcpc_queue(c, seg, NULL);
+    return 0;
+}
+
+/*
+ * 复制帧头hdr, 不复制buf, 两者连续加入发送队列, 
+ * 用于其他线程可能同时向该客户端发送时, buf的释放同tcpc_send_ref
+ */
+int tcpc_send_hdr_ref(tcpc_t tc, void *hdr, int hdr_len, void *buf, int len, 
+                      void (*release)(void *), void *arg)
+{
+	struct tcp_cli *c = (struct tcp_cli*)tc;
+    struct tcpc_seg *seg, *ref = NULL;
+
+    seg = bufp_alloc(sizeof(struct tcpc_seg) + hdr_len);
+    if (!seg) 
+        goto err_rel;
+    memcpy(seg->data, hdr, hdr_len);
+    seg->iov.iov_base = seg->data;
+    seg->iov.iov_len  = hdr_len;
+    seg->release      = NULL;
+    seg->arg          = NULL;
+
+    if (len > 0) {
+        ref = bufp_alloc(sizeof(struct tcpc_seg));
+        if (!ref) {
+            bufp_put(seg);
+            goto err_rel;
+        }
+        ref->iov.iov_base = buf;
+        ref->iov.iov_len  = len;
+        ref->release      = release;
+        ref->arg          = arg;
+    } else if (release) {
+        release(arg);
+    }
+    tcpc_queue(c, seg, ref);
+    return 0;
+err_rel:
+    if (release)
+        release(arg);
+    return -1;
+}
+
+/*
+ * 发送队列中未发送的字节数, 可以在任何线程中调用
+ */
+int tcpc_get_tx_len(tcpc_t tc)
+{
+	struct tcp_cli *c = (struct tcp_cli*)tc;
+    int len;
+
+    pthread_mutex_lock(&c->tx_mutex);
+    len = c->tx_len;
+    pthread_mutex_unlock(&c->tx_mutex);
+    return len;
 }
 
 static void tcpc_free(struct tcp_cli *c)
 {
 	struct tcp_srv *s = c->srv;
-    if (app_event_epolled(c->ev_rx))
-        app_del_event(s->app, c->ev_rx);
-    else if (app_event_epolled(c->ev_tx))
-        app_del_event(s->app, c->ev_tx);
+    app_del_event(c->app, c->ev);
+    app_timer_del(c->app, &c->timer);
 
     if (s->uninit)  
         s->uninit((tcpc_t)c);
 
-    app_event_free(c->ev_rx);
-    app_event_free(c->ev_tx);
+    while (!list_empty(&c->tx_queue)) 
+        tcpc_seg_free(list_first_entry(&c->tx_queue, struct tcpc_seg, entry));
+    pthread_mutex_destroy(&c->tx_mutex);
+
+    app_event_free(c->ev);
     close(c->sock);
     free(c);   
 }
 
+static void tcpc_close(struct tcp_cli *c)
+{
+	struct tcp_srv *s = c->srv;
+    pthread_mutex_lock(&s->mutex);
+    list_del(&c->entry);
+    pthread_mutex_unlock(&s->mutex);
+    tcpc_free(c); 
+}
+
+/*
+ * 读事件以边沿触发方式注册, 需一直读到EAGAIN, 
+ * 处理请求产生的应答在读完后合并发送, 
+ * 若应答过多或没有发送完, 剩余请求留待应答发送完再处理
+ */
 static void rx_app_handler(int sock, void *arg)
 {
 	struct tcp_cli *c = arg;
 	struct tcp_srv *s = c->srv;
     char buf[BUFSIZ];
-    int res = 0;
+    int res = 0, err = 0;
+    bool drained;
 
     if (sock != c->sock) {
         pr_debug("sock = %d, c->sock = %d.\n", sock, c->sock);
         return;
     } 
 
-    c->last_active = time(NULL);
-    if (s->recv_handler) {
-        res = s->recv_handler((tcpc_t)c);
-    } else {
-        res = recv(sock, buf, BUFSIZ, 0);
+    c->last_active = app_timer_now(c->app);
+    /* 其他线程的tcpc_send*在tx_mutex下读写in_rx和tx_len */
+    pthread_mutex_lock(&c->tx_mutex);
+    c->in_rx = true;
+    pthread_mutex_unlock(&c->tx_mutex);
+    for (;;) {
+        do {
+            if (s->recv_handler) {
+                res = s->recv_handler((tcpc_t)c);
+            } else {
+                res = recv(sock, buf, BUFSIZ, 0);
+            }
+        } while (res > 0 && tcpc_get_tx_len((tcpc_t)c) < TCPC_TX_HIGH);
+        err = errno;
+
+        pthread_mutex_lock(&c->tx_mutex);
+        if (tcpc_flush(c) == -1) {
+            pthread_mutex_unlock(&c->tx_mutex);
+            perror("rx_app_handler: tcpc_flush");
+            goto err_close;
+        }
+        if (res <= 0 || c->tx_len > 0)
+            break;
+        pthread_mutex_unlock(&c->tx_mutex);
+    }
+    c->in_rx = false;
+    tcpc_update_event(c);
+    drained = (c->tx_len == 0);
+    pthread_mutex_unlock(&c->tx_mutex);
+
+    if (res > 0 || (res < 0 && (err == EAGAIN || err == EWOULDBLOCK ||
+                                err == EINTR))) {
+        if (drained && s->drain_handler)
+            s->drain_handler((tcpc_t)c);
+        return;
     }
 
-    if (res <= 0) { /* connection closed */
-        if (res < 0) {
-            perror("rx_app_handler");
-        } else {
-            pr_debug("client(addr: %s, port: %d, sock: %d) has disconnected\n", 
-                    inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
-        }
-        pthread_mutex_lock(&s->mutex);
-        list_del(&c->entry);
-        pthread_mutex_unlock(&s->mutex);
-        tcpc_free(c); 
+    if (res < 0) {
+        perror("rx_app_handler");
+    } else {
+        pr_debug("client(addr: %s, port: %d, sock: %d) has disconnected\n", 
+                inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
     }
+err_close:
+    tcpc_close(c);
 }
 
 static void tx_app_handler(int sock, void *arg)
 {
 	struct tcp_cli *c = arg;
 	struct tcp_srv *s = c->srv;
-    int res = 0;
+    bool drained;
 
     if (sock != c->sock) {
         pr_debug("sock = %d, c->sock = %d.\n", sock, c->sock);
         return;
     } 
 
-    c->last_active = time(NULL);
-    res = send(sock, c->buf, c->len, 0);
+    c->last_active = app_timer_now(c->app);
+    pthread_mutex_lock(&c->tx_mutex);
+    if (tcpc_flush(c) == -1) {
+        pthread_mutex_unlock(&c->tx_mutex);
+        perror("tx_app_handler");
+        tcpc_close(c);
+        return;
+    }
 
-    if (res > 0) {
-        c->len -= res;
-        if (c->len == 0) {
-            app_del_event(s->app, c->ev_tx);
-            app_add_event(s->app, c->ev_rx);
-        }
-    } else {
-        if (res < 0) {
-            perror("tx_app_handler");
-        } else {
-            pr_debug("client(addr: %s, port: %d, sock: %d) has disconnected\n", 
-                    inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
-        }
-        pthread_mutex_lock(&s->mutex);
-        list_del(&c->entry);
-        pthread_mutex_unlock(&s->mutex);
-        tcpc_free(c); 
+    /* 发送完后重新关注读事件, 边沿触发下若已有数据到达会立即通知 */
+    tcpc_update_event(c);
+    drained = (c->tx_len == 0);
+    pthread_mutex_unlock(&c->tx_mutex);
+
+    if (drained && s->drain_handler)
+        s->drain_handler((tcpc_t)c);
+}
+
+/*
+ * 超时定时器在客户端所在app的线程中到期, 与读写处理不会并发;
+ * 读写时只记录活动时间, 到期时若期间有活动则按剩余时间重新设置
+ */
+static void tcpc_timeout_handler(struct app_timer *t)
+{
+	struct tcp_cli *c = container_of(t, struct tcp_cli, timer);
+	struct tcp_srv *s = c->srv;
+    int idle_ms = (app_timer_now(c->app) - c->last_active) * APP_TIMER_TICK_MS;
+
+    if (idle_ms < s->timeout * 1000) {
+        app_timer_mod(c->app, t, s->timeout * 1000 - idle_ms);
+        return;
     }
+
+    pr_debug("client(addr: %s, port: %d, sock: %d) timeout\n", 
+             inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
+    tcpc_close(c);
 }
 
-static void srv_app_handler(int sock, void *arg)
+/*
+ * 描述符用完时accept失败, 待接受的连接仍留在监听队列中, 监听事件是边沿触发的,
+ * 不会再有新的通知. 先关闭备用描述符腾出一个位置, 接受并立即关闭一个连接后
+ * 再重新打开备用描述符, 这样监听队列能被取空; 备用描述符也拿不到时只能定时重试
+ */
+static int srv_shed_cli(struct tcp_srv *s)
+{
+    int nfd;
+
+    if (s->spare_fd == -1) {
+        app_timer_mod(s->app, &s->retry, TCPS_ACCEPT_RETRY_MS);
+        return -1;
+    }
+
+    close(s->spare_fd);
+    nfd = accept(s->sock, NULL, NULL);
+    if (nfd != -1)
+        close(nfd);
+    s->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pr_debug("out of descriptors, client(sock: %d) has been rejected\n", nfd);
+
+    if (nfd == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            app_timer_mod(s->app, &s->retry, TCPS_ACCEPT_RETRY_MS);
+        return -1;
+    }
+    return 0;
+}
+
+static void srv_app_handler(int sock, void *arg);
+
+static void srv_retry_handler(struct app_timer *t)
+{
+    struct tcp_srv *s = container_of(t, struct tcp_srv, retry);
+
+    if (s->spare_fd == -1)
+        s->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    srv_app_handler(s->sock, s);
+}
+
+/*
+ * 接受一个连接, 返回-1表示当前已无待接受的连接或出错
+ */
+static int srv_accept_cli(struct tcp_srv *s)
 {
-	struct tcp_srv *s = arg;
     struct tcp_cli *c;
     int nfd;
     struct sockaddr_in sin;
     socklen_t len = sizeof(struct sockaddr_in);
 
-    if (sock != s->sock) {
-        pr_debug("sock = %d, s->sock = %d.\n", sock, s->sock);
-        return;
-    } 
-
-    if((nfd = accept(s->sock, (struct sockaddr*)&sin, &len)) == -1) {
-        if(errno != EAGAIN && errno != EINTR)
-            perror("accept");
-        return;
+    /* 直接得到非阻塞的套接字, 省去两次fcntl调用 */
+    nfd = accept4(s->sock, (struct sockaddr*)&sin, &len, 
+                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (nfd == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+            return 0;
+        if (errno == EMFILE || errno == ENFILE)
+            return srv_shed_cli(s);
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept4");
+        return -1;
     }
 
-    if (-1 == setnonblocking(nfd))
-        goto err_rej;
-
     c = calloc(1, sizeof(struct tcp_cli));
     if (!c) {
         perror("calloc tcp_cli");
@@ -185,75 +490,77 @@ static void srv_app_handler(int sock, void *arg)
     c->sock = nfd;
     memcpy(&c->addr, &sin, len);
     c->srv = s;
+    c->app = s->grp ? app_group_pick(s->grp) : s->app;
     pr_debug("client(addr: %s, port: %d, sock: %d) has connected\n", 
             inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
 
-    c->last_active = time(NULL);
+    app_timer_init(&c->timer, tcpc_timeout_handler);
+    INIT_LIST_HEAD(&c->tx_queue);
+    pthread_mutex_init(&c->tx_mutex, NULL);
 
-    c->ev_rx = app_event_create(c->sock);
-    if (NULL == c->ev_rx) 
+    c->ev = app_event_create(c->sock);
+    if (NULL == c->ev) 
         goto err_mem;
-    app_event_add_notifier(c->ev_rx, NOTIFIER_READ, rx_app_handler, c);
-
-    c->ev_tx = app_event_create(c->sock);
-    if (NULL == c->ev_tx) 
-        goto err_evrx;
-    app_event_add_notifier(c->ev_tx, NOTIFIER_WRITE, tx_app_handler, c);
+    app_event_add_notifier(c->ev, NOTIFIER_READ | NOTIFIER_EDGE, 
+                           rx_app_handler, c);
+    app_event_add_notifier(c->ev, NOTIFIER_WRITE | NOTIFIER_EDGE, 
+                           tx_app_handler, c);
+    app_mod_event(c->app, c->ev, true, false);  /* 有应答要发时才关注写 */
 
     if (s->init && s->init((tcpc_t)c, s->arg) == -1)
-        goto err_evtx; 
-
-    if (app_add_event(c->srv->app, c->ev_rx) == -1)
-        goto err_init;
+        goto err_ev; 
 
+    /* 
+     * 客户端可能在其他app的线程中处理, 加入epoll后随时可能被释放,
+     * 所以先加入客户端列表
+     */
     pthread_mutex_lock(&s->mutex);
     list_add_tail(&c->entry, &s->cli_list); 
     pthread_mutex_unlock(&s->mutex);
 
+    /* app中原来没有定时器时, 加入定时器才会更新app_timer_now */
+    if (s->timeout > 0)
+        app_timer_mod(c->app, &c->timer, s->timeout * 1000);
+    c->last_active = app_timer_now(c->app);
 
-    return;
-err_init:
+    if (app_add_event(c->app, c->ev) == -1)
+        goto err_list;
+
+    return 0;
+err_list:
+    app_timer_del(c->app, &c->timer);
+    pthread_mutex_lock(&s->mutex);
+    list_del(&c->entry);
+    pthread_mutex_unlock(&s->mutex);
     if (s->uninit)  
         s->uninit((tcpc_t)c);
-err_evtx:
-    app_event_free(c->ev_tx);
-err_evrx:
-    app_event_free(c->ev_rx);
+err_ev:
+    app_event_free(c->ev);
 err_mem:
+    pthread_mutex_destroy(&c->tx_mutex);
     free(c);
 err_rej:
     close(nfd);
 
-    pr_debug("client(addr: %s, port: %d, sock: %d) has disconnected\n", 
-            inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
+    pr_debug("client(addr: %s, port: %d, sock: %d) has been rejected\n", 
+            inet_ntoa(sin.sin_addr), sin.sin_port, nfd);
+    return 0;
 }
 
-static void *timeout_handler(void *arg)
+/*
+ * 监听事件以边沿触发方式注册, 一次接受所有待接受的连接
+ */
+static void srv_app_handler(int sock, void *arg)
 {
-    struct tcp_srv *s = arg; 
-    struct tcp_cli *c, *tmpc; 
-    time_t now, duration; 
-    
-	while (!s->need_stop) {
-        sleep(s->timeout_check_per_s);
-        if (list_empty(&s->cli_list))
-            continue;
-
-        now = time(NULL);
-        pthread_mutex_lock(&s->mutex);
-        list_for_each_entry_safe(c, tmpc, &s->cli_list, entry) {  
-            duration = now - c->last_active; 
-            if (duration >= s->timeout) {
-                pr_debug("duration = %lu, s->timeout = %d\n", duration, s->timeout);
-                pr_debug("client(addr: %s, port: %d, sock: %d) timeout\n", 
-                         inet_ntoa(c->addr.sin_addr), c->addr.sin_port, c->sock);
-                list_del(&c->entry);
-                tcpc_free(c);
-            }
-        }
-        pthread_mutex_unlock(&s->mutex);
-    }
-    return NULL;
+	struct tcp_srv *s = arg;
+
+    if (sock != s->sock) {
+        pr_debug("sock = %d, s->sock = %d.\n", sock, s->sock);
+        return;
+    } 
+
+    while (srv_accept_cli(s) == 0)
+        ;
 }
 
 void tcps_set_cli_recvhandler(tcp_srv_t srv, tcpc_handler_t handler)
@@ -275,19 +582,40 @@ void tcps_set_cli_uninit(tcp_srv_t srv, void (*uninit)(tcpc_t))
     s->uninit = uninit;
 }
 
-void tcps_set_timeout(tcp_srv_t srv, int timeout)
+/*
+ * 客户端发送队列在其所在app的线程中发送完时调用handler, 
+ * 可以在handler中继续发送
+ */
+void tcps_set_cli_drainhandler(tcp_srv_t srv, void (*handler)(tcpc_t))
 {
     struct tcp_srv *s = srv;
-    s->timeout = timeout; 
+    s->drain_handler = handler;
+}
+
+/*
+ * 新连接的客户端分派到组内事件最少的app中处理, 
+ * 监听套接字仍留在tcps_create时指定的app中
+ */
+void tcps_set_cli_apps(tcp_srv_t srv, app_group_t grp)
+{
+    struct tcp_srv *s = srv;
+    s->grp = grp;
 }
 
-void tcps_set_timeout_check(tcp_srv_t srv, int per_s)
+/*
+ * 设置客户端无请求超时时间, 单位是秒, 只对之后连接的客户端有效
+ */
+void tcps_set_timeout(tcp_srv_t srv, int timeout)
 {
     struct tcp_srv *s = srv;
-    s->timeout_check_per_s = per_s; 
+    s->timeout = timeout; 
 }
 
-tcp_srv_t tcps_create(app_t app, int port) 
+/*
+ * reuseport非0时监听套接字设置SO_REUSEPORT, 可以在每个app中各创建一个
+ * 同端口的tcp_srv, 由内核把新连接分配到各监听套接字, 客户端留在本app处理
+ */
+tcp_srv_t tcps_create(app_t app, int port, int backlog, int reuseport) 
 {
     struct tcp_srv *s = calloc(1, sizeof(struct tcp_srv));
     if (!s) {
@@ -297,30 +625,31 @@ tcp_srv_t tcps_create(app_t app, int port)
 
 	if (port < 1000)
 		port = DEF_TCP_SRV_PORT;
+    if (backlog <= 0)
+        backlog = DEF_LISTEN_BACKLOG;
 
-    if (-1 == (s->sock = tcp_srv_sock(port))) 
+    if (-1 == (s->sock = tcp_srv_sock(port, backlog, reuseport))) 
         goto err_mem;
 
+    /* 拿不到备用描述符不影响服务, 描述符用完时改为定时重试 */
+    s->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    app_timer_init(&s->retry, srv_retry_handler);
+
     if (-1 == setnonblocking(s->sock))
-        goto err_mem;
+        goto err_sock;
 
 	INIT_LIST_HEAD(&s->cli_list);
-    s->timeout_check_per_s = DEF_TIMEOUT_CHECK_PER_S;
     s->timeout = DEF_TIMEOUT;
 	if (pthread_mutex_init(&s->mutex, NULL)) {
 		perror("tcps_create: pthread_mutex_init");
 		goto err_sock;	
 	}
     
-	if (pthread_create(&s->tid, NULL, timeout_handler, s)) {
-		perror("tcps_create: pthread_create");
-		goto err_mutex;
-	}
-    
     s->ev = app_event_create(s->sock);
     if (NULL == s->ev) 
-        goto err_thread;
-    app_event_add_notifier(s->ev, NOTIFIER_READ, srv_app_handler, s);
+        goto err_mutex;
+    app_event_add_notifier(s->ev, NOTIFIER_READ | NOTIFIER_EDGE, 
+                           srv_app_handler, s);
 
     s->app = app;
     if (app_add_event(s->app, s->ev) == -1) 
@@ -329,12 +658,11 @@ tcp_srv_t tcps_create(app_t app, int port)
 	return s;
 err_appev:
     app_event_free(s->ev);
-err_thread:
-    s->need_stop = true;
-    pthread_join(s->tid, NULL);
 err_mutex:
     pthread_mutex_destroy(&s->mutex);
 err_sock:
+    if (s->spare_fd != -1)
+        close(s->spare_fd);
     close(s->sock);
 err_mem:
     free(s);
@@ -348,13 +676,14 @@ void tcps_free(tcp_srv_t srv)
 
     app_del_event(s->app, s->ev);
     app_event_free(s->ev);
-    s->need_stop = true;
-    pthread_join(s->tid, NULL);
+    app_timer_del(s->app, &s->retry);
     pthread_mutex_destroy(&s->mutex);
     list_for_each_entry_safe(c, tmpc, &s->cli_list, entry) {  
         list_del(&c->entry);
         tcpc_free(c);
     }
+    if (s->spare_fd != -1)
+        close(s->spare_fd);
     close(s->sock);
     free(s);
 }
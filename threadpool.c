@@ -6,15 +6,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 
 #include <cam/threadpool.h>
+#include <cam/bufpool.h>
+#include <cam/utils.h>
 
 #if defined(DBG_TPOOL)
 #define pr_debug(fmt, ...) \
@@ -24,160 +31,619 @@
     do {} while(0)
 #endif
  
+/*
+ * 任务队列是有界的多生产者多消费者环形队列(Dmitry Vyukov的算法),
+ * 任务直接存放在槽中, 不需要为每个任务分配内存;
+ * 每个槽的seq表示该槽的状态: seq == pos时可写入, seq == pos + 1时可读出
+ */
 struct worker { 
+    volatile unsigned long seq;
     void *(*proc) (void *arg); 
     void *arg;        
-    struct worker *next; 
 }; 
 
+/*
+ * 可等待的任务, 引用计数为0时放回缓冲区池
+ */
+struct pool_task {
+    void *(*proc) (void *arg); 
+    void *arg;        
+    void *ret;
+    int ref;
+    volatile int state;                 /* POOL_TASK_* */
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    void (*then)(pool_task_t, void *);  /* 完成后调用 */
+    void *then_arg;
+
+    struct pool_cq *cq;                 /* 完成后放入的完成队列 */
+    struct pool_task *next;
+};
+
+/*
+ * 完成队列, 任务在线程池中完成后放入无锁栈并写eventfd, 
+ * 事件循环线程读eventfd后取出全部任务, 在事件循环线程中调用回调函数
+ */
+struct pool_cq {
+    int fd;
+    app_t app;
+    app_event_t ev;
+    struct pool_task * volatile head;
+    int pending;                        /* 已加入还未处理完的任务数 */
+};
+
+#define CACHE_LINE      64
+
 struct thread_pool { 
-    pthread_mutex_t queue_lock; 
-    pthread_cond_t queue_ready; 
-    struct worker *queue_head; 
+    struct worker *queue;
+    unsigned long queue_mask;           /* 环形队列长度 - 1, 长度为2的幂 */
+    int capacity;                       /* 最多等待执行的任务数 */
+    int policy;                         /* 队列满时的处理方式 */
+    volatile unsigned long enq_pos __attribute__((aligned(CACHE_LINE)));
+    volatile unsigned long deq_pos __attribute__((aligned(CACHE_LINE)));
+    sem_t queue_ready __attribute__((aligned(CACHE_LINE))); /* 可取出的任务数, 每次只唤醒一个线程 */
+    sem_t queue_space;                  /* 可加入的任务数 */
+
+    void (*drop)(void *(*proc)(void *), void *arg);
+    unsigned long dropped;
+    unsigned long rejected;
+
     bool need_destroy; 
     pthread_t *threadid; 
     int thread_num; 
-    int cur_queue_size; 
+    struct thread_sched sched;
+    bool has_sched;
 }; 
  
 void *thread_routine (void *arg); 
 
-thread_pool_t pool_create(int thread_num) 
+/*
+ * stack_size为0时使用DEF_POOL_STACK_SIZE, sched为NULL时使用默认调度策略
+ */
+thread_pool_t pool_create(int thread_num, int capacity, int policy,
+                          int stack_size, const struct thread_sched *sched) 
 { 
     int i = 0; 
+    unsigned long len;
 	pthread_attr_t attr;
 	struct thread_pool *pool;
 	
-    pool = (struct thread_pool*)malloc(sizeof(*pool)); 
+    pool = (struct thread_pool*)calloc(1, sizeof(*pool)); 
     if (!pool) {
 		perror("pool_create");
 		return NULL;
 	}
-    pthread_mutex_init(&(pool->queue_lock), NULL); 
-    pthread_cond_init(&(pool->queue_ready), NULL); 
 
-    pool->queue_head = NULL; 
+    if (capacity <= 0)
+        capacity = DEF_POOL_QUEUE_LEN;
+    for (len = 1; len < capacity; len <<= 1)
+        ;
+    pool->queue = calloc(len, sizeof(struct worker));
+    if (!pool->queue) {
+		perror("pool_create: queue");
+        goto err_mem;
+    }
+    pool->queue_mask = len - 1;
+    for (i = 0; i < len; i++) 
+        pool->queue[i].seq = i;
+    pool->enq_pos  = 0;
+    pool->deq_pos  = 0;
+    pool->capacity = capacity;
+    pool->policy   = policy;
 
+    if (sem_init(&pool->queue_ready, 0, 0)) {
+		perror("pool_create: sem_init");
+        goto err_queue;
+    }
+    if (sem_init(&pool->queue_space, 0, capacity)) {
+		perror("pool_create: sem_init");
+        goto err_ready;
+    }
     pool->thread_num = thread_num; 
-    pool->cur_queue_size = 0; 
-
     pool->need_destroy = false; 
+    if (sched) {
+        pool->sched = *sched;
+        pool->has_sched = true;
+    }
 	
     pool->threadid = 
         (pthread_t *)malloc(thread_num * sizeof (pthread_t)); 
+    if (!pool->threadid) {
+		perror("pool_create: threadid");
+        goto err_space;
+    }
 	
 	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, 512*1024);
+	if (stack_size <= 0)
+        stack_size = DEF_POOL_STACK_SIZE;
+	if ((errno = pthread_attr_setstacksize(&attr, stack_size)))
+		perror("pool_create: pthread_attr_setstacksize");
     for (i = 0; i < thread_num; i++) 
         pthread_create(&(pool->threadid[i]), &attr, 
 		               thread_routine, (void*)pool); 
+	pthread_attr_destroy(&attr);
 	return pool;
+
+err_space:
+    sem_destroy(&pool->queue_space);
+err_ready:
+    sem_destroy(&pool->queue_ready);
+err_queue:
+    free(pool->queue);
+err_mem:
+    free(pool);
+    return NULL;
 } 
 
 /*
- * 向线程池中加入任务
+ * 设置任务被丢弃时的回调函数, 用于释放任务参数
+ */
+void pool_set_drop_handler(thread_pool_t tpool, 
+                           void (*drop)(void *(*proc)(void *), void *arg))
+{
+	struct thread_pool *pool = tpool;
+    pool->drop = drop;
+}
+
+void pool_get_stats(thread_pool_t tpool, struct pool_stats *st)
+{
+	struct thread_pool *pool = tpool;
+    int space;
+
+    sem_getvalue(&pool->queue_space, &space);
+    st->capacity  = pool->capacity;
+    st->depth     = pool->capacity - (space > 0 ? space : 0);
+    st->dropped   = pool->dropped;
+    st->rejected  = pool->rejected;
+}
+
+/*
+ * 写入一个任务, 调用前已通过queue_space取得空位
+ */
+static void pool_put_worker(struct thread_pool *pool, 
+                            void *(*proc)(void *), void *arg)
+{
+    struct worker *w;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = pool->enq_pos;
+    for (;;) {
+        w    = &pool->queue[pos & pool->queue_mask];
+        seq  = w->seq;
+        __sync_synchronize();
+        diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&pool->enq_pos, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* 消费者已取走该槽的任务但还未释放 */
+            sched_yield();
+        }
+        pos = pool->enq_pos;
+    }
+
+    w->proc = proc; 
+    w->arg  = arg; 
+    __sync_synchronize();
+    w->seq  = pos + 1;
+
+    sem_post(&pool->queue_ready);
+}
+
+/*
+ * 取出一个任务, 调用前已通过queue_ready确认有任务可取,
+ * 取出后空位留给调用者, 由调用者决定是否归还queue_space
+ */
+static void pool_get_worker(struct thread_pool *pool, struct worker *out)
+{
+    struct worker *w;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = pool->deq_pos;
+    for (;;) {
+        w    = &pool->queue[pos & pool->queue_mask];
+        seq  = w->seq;
+        __sync_synchronize();
+        diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&pool->deq_pos, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* 前面的生产者已占用该槽但还未写完 */
+            sched_yield();
+        }
+        pos = pool->deq_pos;
+    }
+
+    out->proc = w->proc;
+    out->arg  = w->arg;
+    __sync_synchronize();
+    w->seq = pos + pool->queue_mask + 1;
+}
+
+static void *pool_run_task(void *arg);
+static void pool_task_complete(struct pool_task *t, void *ret, int state);
+
+/*
+ * 丢弃一个未执行的任务
+ */
+static void pool_drop_worker(struct thread_pool *pool, struct worker *w)
+{
+    __sync_add_and_fetch(&pool->dropped, 1);
+    if (w->proc == pool_run_task) {
+        pool_task_complete(w->arg, NULL, POOL_TASK_DROPPED);
+        return;
+    }
+    if (pool->drop)
+        pool->drop(w->proc, w->arg);
+}
+
+/*
+ * 按pool->policy取得一个空位, 取不到时返回-1
+ */
+static int pool_get_space(struct thread_pool *pool)
+{
+    struct worker w;
+
+    switch (pool->policy) {
+    case POOL_BLOCK:
+        while (sem_wait(&pool->queue_space)) {
+            if (errno != EINTR)
+                return -1;
+        }
+        return 0;
+    case POOL_DROP_OLDEST:
+        for (;;) {
+            if (sem_trywait(&pool->queue_space) == 0)
+                return 0;
+            /* 取出最早的任务丢弃, 它的空位直接给新任务 */
+            if (sem_trywait(&pool->queue_ready) == 0) {
+                pool_get_worker(pool, &w);
+                pool_drop_worker(pool, &w);
+                return 0;
+            }
+            sched_yield();
+        }
+    case POOL_REJECT:
+    default:
+        if (sem_trywait(&pool->queue_space) == 0)
+            return 0;
+        __sync_add_and_fetch(&pool->rejected, 1);
+        pr_debug("queue is full\n");
+        return -1;
+    }
+}
+
+/*
+ * 向线程池中加入任务, 队列满时的处理方式见pool_create的policy参数,
+ * 任务未被加入时返回-1
  */ 
 int pool_add_worker(thread_pool_t tpool, void *(*proc)(void *), void *arg) 
 { 
 	struct thread_pool *pool = tpool;
-    struct worker *newworker = malloc(sizeof(struct worker)); 
 
-    newworker->proc = proc; 
-    newworker->arg = arg; 
-    newworker->next = NULL;
-	
-    pthread_mutex_lock(&(pool->queue_lock)); 
-	
-    struct worker *memb = pool->queue_head;  /*将任务加入到等待队列中*/ 
-    if (memb != NULL) { 
-        while (memb->next != NULL) 
-            memb = memb->next; 
-        memb->next = newworker; 
-    } else { 
-        pool->queue_head = newworker; 
-    } 
-    assert(pool->queue_head != NULL); 
-    pool->cur_queue_size++; 
-    pr_debug("cur_queue_size = %d\n", pool->cur_queue_size);
-
-    pthread_cond_signal(&(pool->queue_ready)); 
-    pthread_mutex_unlock(&(pool->queue_lock));	
+    if (pool_get_space(pool))
+        return -1;
+    pool_put_worker(pool, proc, arg);
     return 0; 
 } 
 
+static void pool_task_put_(struct pool_task *t)
+{
+    if (__sync_sub_and_fetch(&t->ref, 1))
+        return;
+    pthread_cond_destroy(&t->done);
+    pthread_mutex_destroy(&t->lock);
+    bufp_put(t);
+}
+
+static void pool_task_complete(struct pool_task *t, void *ret, int state)
+{
+    struct pool_cq *cq = t->cq;
+    struct pool_task *head;
+    void (*then)(pool_task_t, void *);
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&t->lock);
+    t->ret   = ret;
+    t->state = state;
+    then     = t->then;
+    pthread_cond_broadcast(&t->done);
+    pthread_mutex_unlock(&t->lock);
+
+    if (cq) {
+        do {
+            head    = cq->head;
+            t->next = head;
+        } while (!__sync_bool_compare_and_swap(&cq->head, head, t));
+        if (write(cq->fd, &one, sizeof(one)) < 0)
+            perror("pool_task_complete: write");
+        return;     /* 线程池的引用交给完成队列 */
+    }
+
+    if (then)
+        then(t, t->then_arg);
+    pool_task_put_(t);
+}
+
+static void *pool_run_task(void *arg)
+{
+    struct pool_task *t = arg;
+    pool_task_complete(t, t->proc(t->arg), POOL_TASK_DONE);
+    return NULL;
+}
+
+static struct pool_task *pool_task_alloc(void *(*proc)(void *), void *arg)
+{
+    struct pool_task *t = bufp_alloc(sizeof(struct pool_task));
+    if (!t) 
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->proc  = proc;
+    t->arg   = arg;
+    t->ref   = 2;       /* 调用者和线程池各一个 */
+    t->state = POOL_TASK_PENDING;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->done, NULL);
+    return t;
+}
+
+static int pool_task_queue(struct thread_pool *pool, struct pool_task *t)
+{
+    if (pool_get_space(pool)) {
+        t->ref = 1;
+        pool_task_put_(t);
+        return -1;
+    }
+    pool_put_worker(pool, pool_run_task, t);
+    return 0;
+}
+
+/*
+ * 加入任务并返回任务句柄, 用pool_task_poll/pool_task_wait取得结果, 
+ * 不再使用时调用pool_task_put; 任务未被加入时返回NULL
+ */
+pool_task_t pool_submit(thread_pool_t tpool, void *(*proc)(void *), void *arg)
+{
+	struct thread_pool *pool = tpool;
+    struct pool_task *t = pool_task_alloc(proc, arg);
+    if (!t)
+        return NULL;
+    if (pool_task_queue(pool, t))
+        return NULL;
+    return t;
+}
+
+/*
+ * 加入任务, 完成(或被丢弃)后在cq所在的事件循环线程中调用done,
+ * done返回后任务句柄自动释放
+ */
+int pool_submit_cq(thread_pool_t tpool, pool_cq_t cq, 
+                   void *(*proc)(void *), void *arg,
+                   void (*done)(pool_task_t, void *), void *done_arg)
+{
+	struct thread_pool *pool = tpool;
+    struct pool_task *t = pool_task_alloc(proc, arg);
+    if (!t)
+        return -1;
+    t->ref      = 1;
+    t->cq       = cq;
+    t->then     = done;
+    t->then_arg = done_arg;
+    __sync_add_and_fetch(&cq->pending, 1);
+    if (pool_task_queue(pool, t)) {
+        __sync_sub_and_fetch(&cq->pending, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * 设置任务完成后的后续处理, 在完成任务的线程中调用, 
+ * 任务已经完成时在当前线程中马上调用
+ */
+void pool_task_then(pool_task_t task, void (*then)(pool_task_t, void *), void *arg)
+{
+    struct pool_task *t = task;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->state == POOL_TASK_PENDING) {
+        t->then     = then;
+        t->then_arg = arg;
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    pthread_mutex_unlock(&t->lock);
+    then(t, arg);
+}
+
+/*
+ * 返回任务状态, 完成时通过ret返回任务函数的返回值
+ */
+int pool_task_poll(pool_task_t task, void **ret)
+{
+    struct pool_task *t = task;
+    int state = t->state;
+
+    __sync_synchronize();
+    if (state != POOL_TASK_PENDING && ret)
+        *ret = t->ret;
+    return state;
+}
+
+/*
+ * 等待任务完成, 返回任务状态
+ */
+int pool_task_wait(pool_task_t task, void **ret)
+{
+    struct pool_task *t = task;
+
+    pthread_mutex_lock(&t->lock);
+    while (t->state == POOL_TASK_PENDING)
+        pthread_cond_wait(&t->done, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+    if (ret)
+        *ret = t->ret;
+    return t->state;
+}
+
+void pool_task_put(pool_task_t task)
+{
+    pool_task_put_(task);
+}
+
+static void pool_cq_handler(int fd, void *arg)
+{
+    struct pool_cq *cq = arg;
+    struct pool_task *list, *t, *next, *prev = NULL;
+    uint64_t cnt;
+
+    if (read(cq->fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("pool_cq_handler: read");
+
+    /* 取出全部完成的任务, 栈是后进先出的, 反转后按完成顺序处理 */
+    list = __sync_lock_test_and_set(&cq->head, NULL);
+    for (t = list; t; t = next) {
+        next    = t->next;
+        t->next = prev;
+        prev    = t;
+    }
+    for (t = prev; t; t = next) {
+        next = t->next;
+        if (t->then)
+            t->then(t, t->then_arg);
+        pool_task_put_(t);
+        __sync_sub_and_fetch(&cq->pending, 1);
+    }
+}
+
+/*
+ * 创建完成队列, 其eventfd加入app中
+ */
+pool_cq_t pool_cq_create(app_t app)
+{
+    struct pool_cq *cq = calloc(1, sizeof(struct pool_cq));
+    if (!cq) {
+		perror("pool_cq_create");
+		return NULL;
+	}
+
+    cq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cq->fd < 0) {
+		perror("pool_cq_create: eventfd");
+        goto err_mem;
+    }
+
+    cq->ev = app_event_create(cq->fd);
+    if (cq->ev == NULL) 
+        goto err_fd;
+    app_event_add_notifier(cq->ev, NOTIFIER_READ, pool_cq_handler, cq);
+    cq->app = app;
+    if (app_add_event(app, cq->ev)) 
+        goto err_ev;
+    return cq;
+
+err_ev:
+    app_event_free(cq->ev);
+err_fd:
+    close(cq->fd);
+err_mem:
+    free(cq);
+    return NULL;
+}
+
+/*
+ * 释放完成队列, 先等待已加入的任务全部完成, 并在当前线程中处理
+ */
+void pool_cq_free(pool_cq_t pcq)
+{
+    struct pool_cq *cq = pcq;
+    struct pollfd pfd;
+
+    app_del_event(cq->app, cq->ev);
+    pfd.fd     = cq->fd;
+    pfd.events = POLLIN;
+    while (cq->pending) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("pool_cq_free: poll");
+            break;
+        }
+        pool_cq_handler(cq->fd, cq);
+    }
+    app_event_free(cq->ev);
+    close(cq->fd);
+    free(cq);
+}
+
 /* 
  * 销毁线程池
  *
- * 等待队列中的任务不会再被执行，但是正在运行的线程会一直 
+ * 等待队列中的任务不会再被执行(交给丢弃回调函数)，但是正在运行的线程会一直 
  * 把任务运行完后再退出
  */ 
 int pool_free(thread_pool_t tpool) 
 { 
 	struct thread_pool *pool = tpool;
+    struct worker w;
     int i; 
 
     if (pool->need_destroy) 
         return -1;   
     pool->need_destroy = true;
+    __sync_synchronize();
 	
-	pthread_mutex_lock(&(pool->queue_lock)); 
     /*唤醒所有等待线程，线程池要销毁了*/ 
-    pthread_cond_broadcast(&(pool->queue_ready)); 
-	pthread_mutex_unlock(&(pool->queue_lock));	
+    for (i = 0; i < pool->thread_num; i++) 
+        sem_post(&pool->queue_ready);
 
     for (i = 0; i < pool->thread_num; i++) 
         pthread_join(pool->threadid[i], NULL); 
     free(pool->threadid); 
 
-    /*销毁等待队列*/ 
-    struct worker *head = NULL; 
-    while (pool->queue_head != NULL) { 
-        head = pool->queue_head; 
-        pool->queue_head = pool->queue_head->next; 
-        free (head); 
-    } 
-    /*条件变量和互斥量也别忘了销毁*/ 
-    pthread_mutex_destroy(&(pool->queue_lock)); 
-    pthread_cond_destroy(&(pool->queue_ready)); 
-     
+    /*丢弃等待队列中的任务*/ 
+    while (pool->deq_pos != pool->enq_pos) {
+        pool_get_worker(pool, &w);
+        pool_drop_worker(pool, &w);
+    }
+
+    sem_destroy(&pool->queue_space);
+    sem_destroy(&pool->queue_ready);
+    free(pool->queue);
     free(pool);  
-    pool = NULL; 
     return 0; 
 } 
 
 void *thread_routine(void *arg) 
 { 
 	struct thread_pool *pool = arg; 
+    struct worker worker;
+
     pr_debug("starting thread 0x%lx\n", pthread_self()); 
+    if (pool->has_sched)
+        thread_set_sched(&pool->sched);
     while (true) { 
-        pthread_mutex_lock(&(pool->queue_lock)); 
- 
-        while (pool->cur_queue_size == 0 && !pool->need_destroy) { 
-            pr_debug("thread 0x%lx is waiting\n", pthread_self()); 
-            pthread_cond_wait (&(pool->queue_ready), &(pool->queue_lock)); 
-        } 
+        pr_debug("thread 0x%lx is waiting\n", pthread_self()); 
+        if (sem_wait(&pool->queue_ready)) {
+            if (errno == EINTR)
+                continue;
+            perror("thread_routine: sem_wait");
+            break;
+        }
 
         if (pool->need_destroy) { 
-            pthread_mutex_unlock(&(pool->queue_lock)); 
             pr_debug("thread 0x%lx will exit\n", pthread_self()); 
             break; 
         } 
         pr_debug("thread 0x%lx is starting to work\n", pthread_self()); 
 
-        assert(pool->cur_queue_size != 0); 
-        assert(pool->queue_head != NULL); 
-         
-        /*等待队列长度减去1，并取出链表中的头元素*/ 
-        pool->cur_queue_size--; 
-        struct worker *worker = pool->queue_head; 
-        pool->queue_head = worker->next; 
-        pthread_mutex_unlock(&(pool->queue_lock)); 
+        pool_get_worker(pool, &worker);
+        sem_post(&pool->queue_space);
 
         /*调用回调函数，执行任务*/ 
-        worker->proc(worker->arg); 
-        free(worker); 
-        worker = NULL; 
+        worker.proc(worker.arg); 
     }  
     pthread_exit(NULL); 
 }
-
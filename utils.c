@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <cam/utils.h>
 
@@ -43,6 +48,46 @@ int readn(int fd, void *pbuf, size_t n)
 	return n - nleft;
 }
 
+/*
+ * 设置调用线程的CPU绑定和调度策略, 失败时打印错误并继续设置其他项
+ */
+int thread_set_sched(const struct thread_sched *ts)
+{
+    struct sched_param sp;
+    cpu_set_t set;
+    int i, ret = 0;
+
+    if (ts == NULL)
+        return 0;
+
+    if (ts->cpus) {
+        CPU_ZERO(&set);
+        for (i = 0; i < sizeof(ts->cpus) * 8; i++) {
+            if (ts->cpus & (1UL << i))
+                CPU_SET(i, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set)) {
+            perror("thread_set_sched: sched_setaffinity");
+            ret = -1;
+        }
+    }
+
+    if (ts->policy == SCHED_OTHER) {
+        /* nice值是按线程设置的 */
+        if (ts->prio && setpriority(PRIO_PROCESS, syscall(SYS_gettid), ts->prio)) {
+            perror("thread_set_sched: setpriority");
+            ret = -1;
+        }
+    } else {
+        sp.sched_priority = ts->prio;
+        if ((errno = pthread_setschedparam(pthread_self(), ts->policy, &sp))) {
+            perror("thread_set_sched: pthread_setschedparam");
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
 int writen(int fd, void *pbuf, size_t n)
 {
 	int nwritten;
@@ -117,7 +162,11 @@ setsockaddr(struct sockaddr_in *addr, char *ip, int port)
 	return 0;
 }
 
-int tcp_srv_sock(int port)
+/*
+ * backlog为监听队列长度, 连接突发时队列过短会导致客户端重传SYN而延迟数秒
+ * reuseport非0时设置SO_REUSEPORT, 多个套接字可绑定同一端口, 由内核分配连接
+ */
+int tcp_srv_sock(int port, int backlog, int reuseport)
 {
 	struct sockaddr_in addr;
 	int on = 1;
@@ -133,6 +182,12 @@ int tcp_srv_sock(int port)
         perror("tcp_srv_sock: setsockopt");
         goto err_sock;
     }
+
+    if (reuseport && -1 == setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 
+                                      &on, sizeof(int))) {
+        perror("tcp_srv_sock: setsockopt SO_REUSEPORT");
+        goto err_sock;
+    }
 		
 	if (-1 == setsockaddr(&addr, NULL, port)) {
         perror("tcp_srv_sock: setsockaddr");
@@ -145,7 +200,7 @@ int tcp_srv_sock(int port)
         goto err_sock;
     }
 		
-	if (-1 == listen(sock, LISTEN_QUEUE_LEN)) {
+	if (-1 == listen(sock, backlog)) {
         perror("tcp_srv_sock: listen");
         goto err_sock;
     }
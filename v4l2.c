@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include <pthread.h>
+
 #include <linux/types.h>
 #include <linux/videodev2.h>
 
@@ -27,12 +29,20 @@
 struct buf {
 	void    *start;
 	int     len;
+    bool    held;       /* 被img_proc持有 */
+};
+
+/* 一个帧大小支持的帧间隔 */
+struct v4l2_frm_ivals {
+    __u32   nr;
+    struct v4l2_frmivalenum *ivals;
 };
 
 struct v4l2_frms_fmt {
     struct v4l2_fmtdesc     fmt;
     __u32   frms_nr;
     struct v4l2_frmsizeenum *frms;
+    struct v4l2_frm_ivals   *ivals;     /* 与frms一一对应 */
 };
 
 struct v4l2_dev {
@@ -40,15 +50,34 @@ struct v4l2_dev {
 	__u8                    name[32];   /* 设备名称 */
 	__u8                    drv[16];    /* driver名称 */
 
-	struct v4l2_uctls       *uctls;     /* 用户控制项 */
+	struct v4l2_uctl_info   *uctls;     /* 用户控制项 */
+    __u32                   uctls_nr;
+    __u32                   legacy_nr;  /* 旧控制项列表中的控制项数 */
+    struct v4l2_uctl_menu   *menus;     /* 各菜单控制项的菜单项, 按控制项的顺序排列 */
+    __u32                   menus_nr;
+    bool                    uctl_cached;/* 已订阅控制项变化事件, uctls中的值即当前值 */
+    __u32                   volatile_nr;/* 值不能缓存的易变控制项数 */
+    __u32                   uctl_ver;   /* uctls每次改变时加1 */
+    bool                    ext_ctrls;  /* 驱动支持ctrl_class为0的VIDIOC_[GS]_EXT_CTRLS */
+    pthread_mutex_t         uctl_mutex;
 
 	struct v4l2_frms_fmt    *ffmts;     
     __u32                    ffmts_nr;   /* 设备支持的像素格式数 */
     __u32                    cur_fmt;    /* 当前像素格式下标 */
     __u32                    cur_frm;    /* 当前帧大小下标 */
+    __u32                    fps;        /* 目标帧率, 0表示使用驱动默认值 */
+    struct v4l2_fract        ival;       /* 驱动实际使用的帧间隔 */
+    struct v4l2_fract        def_ival;   /* 打开设备时驱动默认的帧间隔, fps为0时恢复 */
 
 	struct buf              *buf;       /* 缓冲区 */
 	__u32                   buf_nr;     /* 缓冲区个数 */
+    __u32                   buf_held;   /* 被img_proc持有, 不在驱动队列中的缓冲区个数 */
+    struct buf              *old_buf;   /* 切换格式前仍被持有的缓冲区, 送回时才munmap */
+    __u32                   old_nr;
+    __u32                   old_held;   /* old_buf中还没送回的个数 */
+    bool                    orphan_ok;  /* 驱动可以释放仍被映射的缓冲区 */
+    bool                    streaming;
+    pthread_mutex_t         buf_mutex;
 
 	v4l2_img_proc_t         proc;
     void*                   arg;
@@ -61,75 +90,342 @@ struct v4l2_dev {
 static void v4l2_app_handler(int fd, void *arg);
 
 /*
- * 初始化用户控制项
+ * 控制项是否有可读写的值, 类标记和按钮没有值
+ */
+static inline bool v4l2_uctl_has_val(const struct v4l2_uctl_info *pctl)
+{
+    return pctl->type != V4L2_CTRL_TYPE_BUTTON &&
+           !(pctl->flags & V4L2_CTRL_FLAG_WRITE_ONLY);
+}
+
+/*
+ * 控制项的值是否可以缓存. 易变控制项(如自动曝光下的曝光值)由硬件随时改变, 
+ * 驱动不会为此发送事件, 只能每次从驱动读取
+ */
+static inline bool v4l2_uctl_cacheable(const struct v4l2_uctl_info *pctl)
+{
+#if defined(V4L2_CTRL_FLAG_VOLATILE)
+    if (pctl->flags & V4L2_CTRL_FLAG_VOLATILE)
+        return false;
+#endif
+    return v4l2_uctl_has_val(pctl);
+}
+
+/*
+ * 订阅所有可缓存控制项的变化事件, 之后控制项的值从uctls中读取, 
+ * 由其他进程或驱动改变的值通过事件更新, 本进程设置的值设置成功后直接更新.
+ * 驱动不支持控制项事件时, 以及易变控制项, 每次读取仍调用ioctl
+ */
+static void v4l2_uctl_subscribe(struct v4l2_dev *v)
+{
+#if defined(V4L2_EVENT_CTRL)
+	struct v4l2_event_subscription sub;
+    int i;
+
+    for (i = 0; i < v->uctls_nr; i++) {
+        if (!v4l2_uctl_cacheable(&v->uctls[i]))
+            continue;
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id   = v->uctls[i].id;
+        if (-1 == xioctl(v->fd, VIDIOC_SUBSCRIBE_EVENT, &sub)) {
+            pr_debug("VIDIOC_SUBSCRIBE_EVENT: %s, id = 0x%x\n", 
+                     strerror(errno), sub.id);
+            memset(&sub, 0, sizeof(sub));
+            sub.type = V4L2_EVENT_ALL;
+            xioctl(v->fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
+            return;
+        }
+    }
+    v->uctl_cached = true;
+    v->uctl_ver    = 1;
+#endif
+}
+
+static struct v4l2_uctl_info *v4l2_uctl_find(struct v4l2_dev *v, __u32 id)
+{
+    int i;
+    for (i = 0; i < v->uctls_nr; i++) {
+        if (v->uctls[i].id == id)
+            return &v->uctls[i];
+    }
+    return NULL;
+}
+
+/*
+ * 更新缓存的控制项值
+ */
+static void v4l2_uctl_update(struct v4l2_dev *v, __u32 id, __s32 val)
+{
+    struct v4l2_uctl_info *pctl;
+
+    pthread_mutex_lock(&v->uctl_mutex);
+    pctl = v4l2_uctl_find(v, id);
+    if (pctl && pctl->val != val) {
+        pctl->val = val;
+        v->uctl_ver++;
+    }
+    pthread_mutex_unlock(&v->uctl_mutex);
+}
+
+/*
+ * 从缓存中读取控制项的值, 没有缓存或控制项易变时返回false
+ */
+static bool v4l2_uctl_lookup(struct v4l2_dev *v, __u32 id, __s32 *val)
+{
+    struct v4l2_uctl_info *pctl;
+
+    if (!v->uctl_cached)
+        return false;
+
+    pthread_mutex_lock(&v->uctl_mutex);
+    pctl = v4l2_uctl_find(v, id);
+    if (pctl && v4l2_uctl_cacheable(pctl))
+        *val = pctl->val;
+    else
+        pctl = NULL;
+    pthread_mutex_unlock(&v->uctl_mutex);
+    return pctl != NULL;
+}
+
+/*
+ * 从驱动读取没有缓存的控制项的值, 有缓存时只读取易变控制项
+ */
+static void v4l2_uctl_refresh(struct v4l2_dev *v)
+{
+	struct v4l2_control ctl;
+    int i;
+
+    if (v->uctl_cached && !v->volatile_nr)
+        return;
+
+    for (i = 0; i < v->uctls_nr; i++) {
+        if (!v4l2_uctl_has_val(&v->uctls[i]) ||
+            (v->uctl_cached && v4l2_uctl_cacheable(&v->uctls[i])))
+            continue;
+        ctl.id = v->uctls[i].id;
+        if (0 == ioctl(v->fd, VIDIOC_G_CTRL, &ctl))
+            v4l2_uctl_update(v, ctl.id, ctl.value);
+    }
+}
+
+/*
+ * 控制项事件以POLLPRI通知, 在采集所在app的线程中处理. 
+ * 设备事件不在epoll中(未采集或缓冲区都被持有)时, 事件在驱动中排队, 
+ * 同一控制项的事件会合并, 重新加入epoll后处理
+ */
+static void v4l2_event_handler(int fd, void *arg)
+{
+#if defined(V4L2_EVENT_CTRL)
+	struct v4l2_dev *v = arg;
+    struct v4l2_event ev;
+    struct v4l2_uctl_info *pctl;
+
+    for (;;) {
+        memset(&ev, 0, sizeof(ev));
+        if (-1 == xioctl(v->fd, VIDIOC_DQEVENT, &ev))
+            break;
+        if (ev.type != V4L2_EVENT_CTRL)
+            continue;
+
+        pthread_mutex_lock(&v->uctl_mutex);
+        pctl = v4l2_uctl_find(v, ev.id);
+        if (pctl && (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE))
+            pctl->val = ev.u.ctrl.value;
+        if (pctl && (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_RANGE)) {
+            pctl->min     = ev.u.ctrl.minimum;
+            pctl->max     = ev.u.ctrl.maximum;
+            pctl->step    = ev.u.ctrl.step;
+            pctl->def_val = ev.u.ctrl.default_value;
+        }
+        if (pctl && (ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_FLAGS))
+            pctl->flags = ev.u.ctrl.flags;
+        if (pctl)
+            v->uctl_ver++;
+        pthread_mutex_unlock(&v->uctl_mutex);
+        pr_debug("control 0x%x changed, val = %d\n", ev.id, ev.u.ctrl.value);
+    }
+#endif
+}
+
+/*
+ * 控制项是否在旧的控制项列表(VID_GET_UCTLS)中, 
+ * 旧列表只有用户类的基本控制项, 不含菜单, 保持旧客户端看到的列表不变
+ */
+static inline bool v4l2_uctl_legacy(const struct v4l2_uctl_info *pctl)
+{
+    return pctl->id >= V4L2_CID_BASE && pctl->id < V4L2_CID_LASTP1 &&
+           pctl->type != V4L2_CTRL_TYPE_MENU && 
+           pctl->type != V4L2_CTRL_TYPE_INTEGER_MENU;
+}
+
+/*
+ * 查询下一个控制项, 驱动支持V4L2_CTRL_FLAG_NEXT_CTRL时按驱动的顺序枚举
+ * 所有类的控制项, 否则依次查询基本控制项和驱动私有控制项. 
+ * 没有更多控制项时返回-1
+ */
+static int v4l2_uctl_query_next(struct v4l2_dev *v, struct v4l2_queryctrl *qctl,
+                                bool *next_ctrl)
+{
+    __u32 id = qctl->id;
+
+    if (*next_ctrl) {
+        qctl->id = id | V4L2_CTRL_FLAG_NEXT_CTRL;
+        if (0 == ioctl(v->fd, VIDIOC_QUERYCTRL, qctl))
+            return 0;
+        if (id != 0 || errno != EINVAL)
+            return -1;
+        /* 第一次查询就失败, 驱动不支持NEXT_CTRL */
+        *next_ctrl = false;
+        id = V4L2_CID_BASE - 1;
+    }
+
+    for (;;) {
+        if (id + 1 == V4L2_CID_LASTP1)
+            id = V4L2_CID_PRIVATE_BASE - 1;
+        memset(qctl, 0, sizeof(*qctl));
+        qctl->id = ++id;
+        if (0 == ioctl(v->fd, VIDIOC_QUERYCTRL, qctl))
+            return 0;
+        if (errno != EINVAL || id >= V4L2_CID_PRIVATE_BASE)
+            return -1;
+    }
+}
+
+/*
+ * 读取菜单控制项的各菜单项, 追加到v->menus, 返回菜单项个数
+ */
+static int v4l2_uctl_menu_setup(struct v4l2_dev *v, struct v4l2_queryctrl *qctl)
+{
+	struct v4l2_querymenu qmenu;
+    struct v4l2_uctl_menu *menus, *pmenu;
+    int nr = 0;
+
+    memset(&qmenu, 0, sizeof(qmenu));
+    qmenu.id = qctl->id;
+    for (qmenu.index = qctl->minimum; 
+         qmenu.index <= qctl->maximum; qmenu.index++) {
+        /* 菜单项可能不连续 */
+        if (-1 == ioctl(v->fd, VIDIOC_QUERYMENU, &qmenu))
+            continue;
+
+        menus = realloc(v->menus, (v->menus_nr + 1) * sizeof(*menus));
+        if (!menus) {
+            perror("realloc for menus");
+            return -1;
+        }
+        v->menus = menus;
+        pmenu = &v->menus[v->menus_nr++];
+        memset(pmenu, 0, sizeof(*pmenu));
+        pmenu->index = qmenu.index;
+        if (qctl->type == V4L2_CTRL_TYPE_INTEGER_MENU)
+            pmenu->value = qmenu.value;
+        else
+            memcpy(pmenu->name, qmenu.name, sizeof(pmenu->name));
+        nr++;
+    }
+    return nr;
+}
+
+/*
+ * 初始化用户控制项, 枚举所有类的控制项, 包括菜单和整数菜单
  */
 static int v4l2_uctl_setup(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
 	struct v4l2_queryctrl qctl;
 	struct v4l2_control ctl;
-    struct v4l2_uctl uctls[V4L2_CID_LASTP1 - V4L2_CID_BASE];
-	int uctls_nr;
+    struct v4l2_uctl_info *uctls, *pctl;
+    bool next_ctrl = true;
+    int menu_nr;
 
 	/* enumerate */
-	uctls_nr = 0;
 	memset(&qctl, 0, sizeof(qctl));
-	for (qctl.id = V4L2_CID_BASE; 
-         qctl.id < V4L2_CID_LASTP1; qctl.id++) {
-		if (-1  == ioctl(v->fd, VIDIOC_QUERYCTRL, &qctl)) {
-            if (errno == EINVAL)
-                continue;
-            perror("VIDIOC_QUERYCTRL");
-            return -1;
-        }
-
+	while (0 == v4l2_uctl_query_next(v, &qctl, &next_ctrl)) {
         if (qctl.flags & V4L2_CTRL_FLAG_DISABLED)
             continue;
 
-        if (qctl.type == V4L2_CTRL_TYPE_MENU) {
-            pr_debug("this device has a V4L2_CTRL_TYPE_MENU, "
-                     "but now we do not support.\n");
+        switch (qctl.type) {
+        case V4L2_CTRL_TYPE_INTEGER:
+        case V4L2_CTRL_TYPE_BOOLEAN:
+        case V4L2_CTRL_TYPE_MENU:
+        case V4L2_CTRL_TYPE_INTEGER_MENU:
+        case V4L2_CTRL_TYPE_BUTTON:
+        case V4L2_CTRL_TYPE_BITMASK:
+            break;
+        default:
+            /* 类标记、64位整数和字符串等控制项的值放不进__s32 */
+            pr_debug("control 0x%x type %d is not supported.\n", 
+                     qctl.id, qctl.type);
             continue;
         }
 
-		memset(&ctl, 0, sizeof(ctl));
-		ctl.id = qctl.id;
-        if (-1 == ioctl(v->fd, VIDIOC_G_CTRL, &ctl)) {
-            perror("VIDIOC_G_CTRL");
-            return -1;
+        menu_nr = 0;
+        if (qctl.type == V4L2_CTRL_TYPE_MENU || 
+            qctl.type == V4L2_CTRL_TYPE_INTEGER_MENU) {
+            menu_nr = v4l2_uctl_menu_setup(v, &qctl);
+            if (menu_nr < 0)
+                goto err_mem;
         }
 
-		uctls[uctls_nr].id   = qctl.id;
-		uctls[uctls_nr].type = qctl.type;
-	    uctls[uctls_nr].val  = ctl.value;
-		uctls[uctls_nr].def_val = qctl.default_value;
-		uctls[uctls_nr].min  = qctl.minimum;
-		uctls[uctls_nr].max  = qctl.maximum;
-		strcpy((char*)uctls[uctls_nr].name, (char*)qctl.name);
-#ifdef DBG_V4L
+        uctls = realloc(v->uctls, (v->uctls_nr + 1) * sizeof(*uctls));
+        if (!uctls) {
+            perror("realloc for uctls");
+            goto err_mem;
+        }
+        v->uctls = uctls;
+        pctl = &v->uctls[v->uctls_nr];
+        memset(pctl, 0, sizeof(*pctl));
+
+        pctl->id      = qctl.id;
+        pctl->type    = qctl.type;
+        pctl->def_val = qctl.default_value;
+        pctl->min     = qctl.minimum;
+        pctl->max     = qctl.maximum;
+        pctl->step    = qctl.step;
+        pctl->flags   = qctl.flags;
+        pctl->menu_nr = menu_nr;
+        memcpy(pctl->name, qctl.name, sizeof(pctl->name));
+
+        pctl->val = qctl.default_value;
+        if (v4l2_uctl_has_val(pctl)) {
+            memset(&ctl, 0, sizeof(ctl));
+            ctl.id = qctl.id;
+            if (-1 == ioctl(v->fd, VIDIOC_G_CTRL, &ctl)) 
+                perror("VIDIOC_G_CTRL");
+            else
+                pctl->val = ctl.value;
+        }
+
+        if (v4l2_uctl_legacy(pctl))
+            v->legacy_nr++;
+        if (v4l2_uctl_has_val(pctl) && !v4l2_uctl_cacheable(pctl))
+            v->volatile_nr++;
+        v->uctls_nr++;
+
 		pr_debug("uctls: id = 0x%x, type = %d, val = %d,\n"
-                "def_val = %d, min = %d, max = %d, name = %s, idx = %d\n", 
-                uctls[uctls_nr].id, uctls[uctls_nr].type,
-                uctls[uctls_nr].val, uctls[uctls_nr].def_val,
-                uctls[uctls_nr].min, uctls[uctls_nr].max,
-                uctls[uctls_nr].name, uctls_nr);
-#endif
-        uctls_nr++;
+                "def_val = %d, min = %d, max = %d, name = %s, menus = %d\n", 
+                pctl->id, pctl->type, pctl->val, pctl->def_val,
+                pctl->min, pctl->max, pctl->name, menu_nr);
 	}
 
-    v->uctls = malloc(sizeof(struct v4l2_uctls) + uctls_nr * sizeof(struct v4l2_uctl));
-    if (v->uctls == NULL) {
-        perror("malloc for uctls");
-        return -1;
-    }
-    v->uctls->nr = uctls_nr;
-    memcpy(v->uctls->list, uctls, uctls_nr * sizeof(struct v4l2_uctl));
+	if (pthread_mutex_init(&v->uctl_mutex, NULL)) {
+		perror("v4l2_uctl_setup: pthread_mutex_init");
+		goto err_mem;
+	}
+    v4l2_uctl_subscribe(v);
     return 0;
+err_mem:
+    free(v->uctls);
+    free(v->menus);
+    return -1;
 }
 
 static inline void v4l2_uctl_free(v4l2_dev_t vd) {
 	struct v4l2_dev *v = vd;
+    pthread_mutex_destroy(&v->uctl_mutex);
     free(v->uctls);
+    free(v->menus);
 }
 
 int v4l2_set_uctl(v4l2_dev_t vd, __u32 id, __s32 val)
@@ -144,19 +440,118 @@ int v4l2_set_uctl(v4l2_dev_t vd, __u32 id, __s32 val)
         return -1;
     }
 
+    /* 本进程的设置不会收到事件, 直接更新缓存, 驱动可能调整了设置的值 */
+    v4l2_uctl_update(v, id, ctl.value);
 	return 0;
 }
 
+/*
+ * 打开设备时检查一次驱动能否用ctrl_class为0的扩展控制项接口读取控制项. 
+ * 老的驱动(如S3C的2.6内核)没有这个接口或要求所有控制项属于ctrl_class, 
+ * 不支持时返回EINVAL而不是ENOTTY, 这时多个控制项只能逐个读写
+ */
+static void v4l2_ext_ctrls_probe(struct v4l2_dev *v)
+{
+    struct v4l2_ext_controls ctls;
+    struct v4l2_ext_control ctl;
+    int i;
+
+    v->ext_ctrls = false;
+    for (i = 0; i < v->uctls_nr; i++) {
+        if (v4l2_uctl_has_val(&v->uctls[i]))
+            break;
+    }
+    if (i == v->uctls_nr)
+        return;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.id = v->uctls[i].id;
+    memset(&ctls, 0, sizeof(ctls));
+    ctls.ctrl_class = 0;
+    ctls.count      = 1;
+    ctls.controls   = &ctl;
+    if (0 == xioctl(v->fd, VIDIOC_G_EXT_CTRLS, &ctls))
+        v->ext_ctrls = true;
+    else
+        pr_debug("VIDIOC_G_EXT_CTRLS: %s, set controls one by one\n", 
+                 strerror(errno));
+}
+
+/*
+ * 用一次VIDIOC_S_EXT_CTRLS设置多个控制项, 驱动保证全部设置或全部不设置. 
+ * 驱动不支持扩展控制项接口, 返回ENOTTY, 或者错误不属于某一个控制项
+ * (error_idx等于nr, 如老的驱动不接受不同类的控制项)时逐个设置, 
+ * 其他错误直接返回. 失败时返回-1并设置errno, err_idx非空时写入出错的
+ * 控制项下标, 等于nr表示错误不属于某一个控制项
+ */
+int v4l2_set_uctl_multi(v4l2_dev_t vd, const struct v4l2_uctl_val *vals, 
+                        __u32 nr, __u32 *err_idx)
+{
+	struct v4l2_dev *v = vd;
+    struct v4l2_ext_controls ctls;
+    struct v4l2_ext_control *ctl;
+    int i, ret = 0, err = 0;
+    __u32 idx = nr;
+
+    if (nr == 0)
+        return 0;
+
+    ctl = calloc(nr, sizeof(struct v4l2_ext_control));
+    if (!ctl) {
+        perror("v4l2_set_uctl_multi");
+        return -1;
+    }
+    for (i = 0; i < nr; i++) {
+        ctl[i].id    = vals[i].id;
+        ctl[i].value = vals[i].val;
+    }
+
+    memset(&ctls, 0, sizeof(ctls));
+    ctls.ctrl_class = 0;            /* 控制项可以属于不同的类 */
+    ctls.count      = nr;
+    ctls.controls   = ctl;
+	if (!v->ext_ctrls || -1 == xioctl(v->fd, VIDIOC_S_EXT_CTRLS, &ctls)) {
+        if (v->ext_ctrls && errno != ENOTTY && ctls.error_idx != nr) {
+            err = errno;
+            idx = ctls.error_idx;
+            fprintf(stderr, "VIDIOC_S_EXT_CTRLS: %s: error_idx = %u\n", 
+                    strerror(err), idx);
+            ret = -1;
+        } else {
+            for (i = 0; i < nr; i++) {
+                if (v4l2_set_uctl(v, vals[i].id, vals[i].val) < 0 && !ret) {
+                    err = errno;
+                    idx = i;
+                    ret = -1;
+                }
+            }
+        }
+    } else {
+        for (i = 0; i < nr; i++) 
+            v4l2_uctl_update(v, ctl[i].id, ctl[i].value);
+    }
+
+    free(ctl);
+    if (ret) {
+        if (err_idx)
+            *err_idx = idx;
+        errno = err;
+    }
+    return ret;
+}
+
 int v4l2_set_uctls2def(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
-    __u32 nr = v->uctls->nr;
     __u32 id;
     __s32 def_val;
     int i;
-    for (i = 0; i < nr; i++) {
-        id      = v->uctls->list[i].id;
-        def_val = v->uctls->list[i].def_val;
+    for (i = 0; i < v->uctls_nr; i++) {
+        if (!v4l2_uctl_has_val(&v->uctls[i]) || 
+            (v->uctls[i].flags & V4L2_CTRL_FLAG_READ_ONLY))
+            continue;
+        id      = v->uctls[i].id;
+        def_val = v->uctls[i].def_val;
         if (v4l2_set_uctl(v, id, def_val) < 0)
             return -1;
     }
@@ -168,6 +563,11 @@ __s32 v4l2_get_uctl(v4l2_dev_t vd, __u32 id, bool *ok)
 	struct v4l2_dev *v = vd;
 	struct v4l2_control ctl;
 
+    if (v4l2_uctl_lookup(v, id, &ctl.value)) {
+        *ok = true;
+        return ctl.value;
+    }
+
     *ok = false;
 	ctl.id = id;
 	if (-1 == ioctl (v->fd, VIDIOC_G_CTRL, &ctl)) {
@@ -179,37 +579,154 @@ __s32 v4l2_get_uctl(v4l2_dev_t vd, __u32 id, bool *ok)
     return ctl.value;
 }
 
-void v4l2_get_uctls(v4l2_dev_t vd, struct v4l2_uctl *uctls)
+/*
+ * 用一次VIDIOC_G_EXT_CTRLS读取vals中各id的值, 
+ * 驱动不支持扩展控制项接口或读取失败时逐个读取, 读取失败的控制项值为-1
+ */
+int v4l2_get_uctl_multi(v4l2_dev_t vd, struct v4l2_uctl_val *vals, __u32 nr)
 {
 	struct v4l2_dev *v = vd;
-    struct v4l2_uctl *pctl; 
-    __s32 val;
+    struct v4l2_ext_controls ctls;
+    struct v4l2_ext_control *ctl;
     bool ok;
+    int i, ret = 0;
+
+    if (nr == 0)
+        return 0;
+
+    for (i = 0; i < nr; i++) {
+        if (!v4l2_uctl_lookup(v, vals[i].id, &vals[i].val))
+            break;
+    }
+    if (i == nr)
+        return 0;
+
+    ctl = calloc(nr, sizeof(struct v4l2_ext_control));
+    if (!ctl) {
+        perror("v4l2_get_uctl_multi");
+        return -1;
+    }
+    for (i = 0; i < nr; i++) 
+        ctl[i].id = vals[i].id;
+
+    memset(&ctls, 0, sizeof(ctls));
+    ctls.ctrl_class = 0;
+    ctls.count      = nr;
+    ctls.controls   = ctl;
+	if (v->ext_ctrls && 0 == xioctl(v->fd, VIDIOC_G_EXT_CTRLS, &ctls)) {
+        for (i = 0; i < nr; i++)
+            vals[i].val = ctl[i].value;
+    } else {
+        if (v->ext_ctrls)
+            pr_debug("VIDIOC_G_EXT_CTRLS: %s\n", strerror(errno));
+        for (i = 0; i < nr; i++) {
+            vals[i].val = v4l2_get_uctl(v, vals[i].id, &ok);
+            if (!ok)
+                ret = -1;
+        }
+    }
+
+    free(ctl);
+    return ret;
+}
+
+/*
+ * 旧的控制项列表, 只有用户类的基本控制项, 共v4l2_get_uctls_nr个
+ */
+void v4l2_get_uctls(v4l2_dev_t vd, struct v4l2_uctl *uctls)
+{
+	struct v4l2_dev *v = vd;
+    struct v4l2_uctl_info *pctl; 
     int i;
 
-    for (i = 0; i < v->uctls->nr; i++) {
-        pctl = &v->uctls->list[i];
-        val  = v4l2_get_uctl(v, pctl->id, &ok);
-        if (ok)
-            pctl->val = val;
+    v4l2_uctl_refresh(v);
+    pthread_mutex_lock(&v->uctl_mutex);
+    for (i = 0; i < v->uctls_nr; i++) {
+        pctl = &v->uctls[i];
+        if (!v4l2_uctl_legacy(pctl))
+            continue;
+        uctls->id      = pctl->id;
+        uctls->type    = pctl->type;
+        uctls->val     = pctl->val;
+        uctls->def_val = pctl->def_val;
+        uctls->min     = pctl->min;
+        uctls->max     = pctl->max;
+        memcpy(uctls->name, pctl->name, sizeof(uctls->name));
+        uctls++;
     }
-    memcpy(uctls, v->uctls->list, v->uctls->nr * sizeof(struct v4l2_uctl));
+    pthread_mutex_unlock(&v->uctl_mutex);
 }
 
 __u32 v4l2_get_uctls_nr(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
-    return v->uctls->nr;
+    return v->legacy_nr;
 }
 
-static int v4l2_mmap_setup(v4l2_dev_t vd)
+/*
+ * 完整的控制项列表的大小, 包括各菜单控制项的菜单项
+ */
+__u32 v4l2_get_uctl_infos_size(v4l2_dev_t vd, __u32 *nr)
 {
 	struct v4l2_dev *v = vd;
+    if (nr)
+        *nr = v->uctls_nr;
+    return v->uctls_nr * sizeof(struct v4l2_uctl_info) + 
+           v->menus_nr * sizeof(struct v4l2_uctl_menu);
+}
+
+/*
+ * 完整的控制项列表, 每个控制项之后紧跟它的menu_nr个菜单项, 
+ * buf至少要有v4l2_get_uctl_infos_size字节
+ */
+void v4l2_get_uctl_infos(v4l2_dev_t vd, void *buf)
+{
+	struct v4l2_dev *v = vd;
+    struct v4l2_uctl_menu *pmenu = v->menus;
+    __u8 *p = buf;
+    int i;
+
+    v4l2_uctl_refresh(v);
+    pthread_mutex_lock(&v->uctl_mutex);
+    for (i = 0; i < v->uctls_nr; i++) {
+        memcpy(p, &v->uctls[i], sizeof(struct v4l2_uctl_info));
+        p += sizeof(struct v4l2_uctl_info);
+        memcpy(p, pmenu, v->uctls[i].menu_nr * sizeof(struct v4l2_uctl_menu));
+        p     += v->uctls[i].menu_nr * sizeof(struct v4l2_uctl_menu);
+        pmenu += v->uctls[i].menu_nr;
+    }
+    pthread_mutex_unlock(&v->uctl_mutex);
+}
+
+/*
+ * 控制项列表的版本, 列表中任何值改变时加1, 
+ * 版本相同时v4l2_get_uctls和v4l2_get_uctl_infos的结果相同.
+ * 没有缓存控制项的值(驱动不支持控制项事件)时返回0, 表示每次都要重新读取
+ */
+__u32 v4l2_get_uctls_ver(v4l2_dev_t vd)
+{
+	struct v4l2_dev *v = vd;
+    __u32 ver;
+
+    if (!v->uctl_cached)
+        return 0;
+    /* 易变控制项的值不会通过事件更新, 先读取, 值改变时版本随之增加 */
+    v4l2_uctl_refresh(v);
+    pthread_mutex_lock(&v->uctl_mutex);
+    ver = v->uctl_ver;
+    pthread_mutex_unlock(&v->uctl_mutex);
+    return ver;
+}
+
+/*
+ * 申请count个驱动缓冲区, count为0时释放所有缓冲区
+ */
+static int v4l2_reqbufs(struct v4l2_dev *v, __u32 *count)
+{
 	struct v4l2_requestbuffers req;
-	int i; 
 
     memset(&req, 0, sizeof(req));
-	req.count  = NR_REQBUF;    		/* 缓存队列长度 */
+	req.count  = *count;
 	req.type   = v->ffmts[v->cur_fmt].fmt.type;
 	req.memory = V4L2_MEMORY_MMAP;
 	
@@ -217,19 +734,34 @@ static int v4l2_mmap_setup(v4l2_dev_t vd)
         perror("VIDIOC_REQBUFS");
         return -1;
     }
+#if defined(V4L2_BUF_CAP_SUPPORTS_ORPHANED_BUFS)
+    v->orphan_ok = !!(req.capabilities & V4L2_BUF_CAP_SUPPORTS_ORPHANED_BUFS);
+#endif
+    *count = req.count;
+    return 0;
+}
 
-	if (req.count < 2) {
+static int v4l2_mmap_setup(v4l2_dev_t vd)
+{
+	struct v4l2_dev *v = vd;
+	__u32 count = NR_REQBUF;    		/* 缓存队列长度 */
+	int i; 
+
+	if (-1 == v4l2_reqbufs(v, &count))
+        return -1;
+
+	if (count < 2) {
 		pr_debug("Insufficient buffer memory\n");
-		return -1;		
+		goto err_req;
 	}
 
-	v->buf = calloc(req.count, sizeof(struct buf));
+	v->buf = calloc(count, sizeof(struct buf));
 	if (!v->buf) {
 		pr_debug("Out of memory\n");
-		return -1;	
+		goto err_req;
 	}
 	
-	for (i = 0; i < req.count; i++) {
+	for (i = 0; i < count; i++) {
 		struct v4l2_buffer buf;
 		bzero(&buf, sizeof(buf));
 
@@ -239,7 +771,7 @@ static int v4l2_mmap_setup(v4l2_dev_t vd)
 
 		if (-1 == xioctl(v->fd, VIDIOC_QUERYBUF, &buf)) {
             perror("VIDIOC_QUERYBUF");
-            goto err_calloc;
+            goto err_mmap;
         }
 
 		v->buf[i].len   = buf.length;
@@ -248,14 +780,20 @@ static int v4l2_mmap_setup(v4l2_dev_t vd)
 
 		if (MAP_FAILED == v->buf[i].start) {
             perror("mmap");
-            goto err_calloc;
+            goto err_mmap;
         }
 	}	
-	v->buf_nr = req.count;
+	v->buf_nr = count;
 	return 0;
 
-err_calloc:
+err_mmap:
+    while (--i >= 0)
+        munmap(v->buf[i].start, v->buf[i].len);
     free(v->buf);
+    v->buf = NULL;
+err_req:
+    count = 0;
+    v4l2_reqbufs(v, &count);
     return -1;
 }
 
@@ -263,6 +801,14 @@ static int v4l2_mmap_free(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
     int i;
+
+    /* 退出时切换格式前的缓冲区可能还在发送队列中 */
+	for (i = 0; i < v->old_nr; i++) {
+        if (v->old_buf[i].start)
+            munmap(v->old_buf[i].start, v->old_buf[i].len);
+    }
+    free(v->old_buf);
+
 	for (i = 0; i < v->buf_nr; i++) {
 		if (-1 == munmap(v->buf[i].start, v->buf[i].len)) {
             perror("munmap");
@@ -273,6 +819,65 @@ static int v4l2_mmap_free(v4l2_dev_t vd)
     return 0;
 }
 
+/*
+ * 枚举各帧大小支持的帧间隔, 驱动不支持枚举时个数为0. 
+ * 帧间隔不是离散值时只有一项, 其中是范围(STEPWISE/CONTINUOUS)
+ */
+static int v4l2_ival_setup(struct v4l2_dev *v, struct v4l2_frms_fmt *pffmt)
+{
+    struct v4l2_frmivalenum ivals[MAX_FRM_IVAL_NR], *pival;
+    int i, n, siz;
+
+    pffmt->ivals = calloc(pffmt->frms_nr, sizeof(struct v4l2_frm_ivals));
+    if (pffmt->ivals == NULL && pffmt->frms_nr) {
+        perror("calloc ffmts.ivals");
+        return -1;
+    }
+
+    for (i = 0; i < pffmt->frms_nr; i++) {
+        for (n = 0; n < MAX_FRM_IVAL_NR; n++) {
+            pival = &ivals[n];
+            bzero(pival, sizeof(*pival));
+            pival->index        = n;
+            pival->pixel_format = pffmt->fmt.pixelformat;
+            pival->width        = pffmt->frms[i].discrete.width;
+            pival->height       = pffmt->frms[i].discrete.height;
+            if (-1 == ioctl(v->fd, VIDIOC_ENUM_FRAMEINTERVALS, pival)) 
+                break;
+            if (pival->type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+                n++;
+                break;
+            }
+        }
+        if (n == 0)
+            continue;
+
+        siz = sizeof(struct v4l2_frmivalenum) * n;
+        pffmt->ivals[i].ivals = malloc(siz);
+        if (pffmt->ivals[i].ivals == NULL) {
+            perror("malloc ffmts.ivals");
+            goto err_mem;
+        }
+        memcpy(pffmt->ivals[i].ivals, ivals, siz);
+        pffmt->ivals[i].nr = n;
+    }
+    return 0;
+
+err_mem:
+    while (--i >= 0)
+        free(pffmt->ivals[i].ivals);
+    free(pffmt->ivals);
+    return -1;
+}
+
+static void v4l2_ival_free(struct v4l2_frms_fmt *pffmt)
+{
+    int i;
+    for (i = 0; i < pffmt->frms_nr; i++) 
+        free(pffmt->ivals[i].ivals);
+    free(pffmt->ivals);
+}
+
 static int v4l2_fmt_setup(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
@@ -337,11 +942,16 @@ static int v4l2_fmt_setup(v4l2_dev_t vd)
             goto err_mem;
         }
         memcpy(v->ffmts[i].frms, frms[i], siz);
+        if (-1 == v4l2_ival_setup(v, &v->ffmts[i])) {
+            free(v->ffmts[i].frms);
+            goto err_mem;
+        }
     }
 
 #ifdef DBG_V4L
-    int j;
+    int j, k;
     struct v4l2_frms_fmt *pffmt;
+    struct v4l2_frmivalenum *pival;
     pr_debug("support %d pixmap formats:\n", v->ffmts_nr);
     for (i = 0; i < v->ffmts_nr; i++) {
         pffmt = &v->ffmts[i];
@@ -350,26 +960,44 @@ static int v4l2_fmt_setup(v4l2_dev_t vd)
 
         for (j = 0; j < pffmt->frms_nr; j++) {
             pfrm = &pffmt->frms[j];
-            pr_debug("   dimension %d: %d x %d\n", pfrm->index, 
-                     pfrm->discrete.width, pfrm->discrete.height);
+            pr_debug("   dimension %d: %d x %d, %d intervals\n", pfrm->index, 
+                     pfrm->discrete.width, pfrm->discrete.height,
+                     pffmt->ivals[j].nr);
+            for (k = 0; k < pffmt->ivals[j].nr; k++) {
+                pival = &pffmt->ivals[j].ivals[k];
+                if (pival->type == V4L2_FRMIVAL_TYPE_DISCRETE)
+                    pr_debug("    interval %d: %u/%u\n", k,
+                             pival->discrete.numerator, 
+                             pival->discrete.denominator);
+                else
+                    pr_debug("    interval: %u/%u - %u/%u\n",
+                             pival->stepwise.min.numerator, 
+                             pival->stepwise.min.denominator,
+                             pival->stepwise.max.numerator, 
+                             pival->stepwise.max.denominator);
+            }
         }
     }
 #endif
 	return 0;
 
 err_mem:
-    free(v->ffmts);
-    for (i = i - 1; i > -1; i--) 
+    for (i = i - 1; i > -1; i--) {
+        v4l2_ival_free(&v->ffmts[i]);
         free(v->ffmts[i].frms);
+    }
+    free(v->ffmts);
     return -1;
 }
 
 static inline void v4l2_fmt_free(v4l2_dev_t vd) {
 	struct v4l2_dev *v = vd;
     int i;
-    free(v->ffmts);
-    for (i = 0; i < v->ffmts_nr; i++) 
+    for (i = 0; i < v->ffmts_nr; i++) {
+        v4l2_ival_free(&v->ffmts[i]);
         free(v->ffmts[i].frms);
+    }
+    free(v->ffmts);
 }
 
 int v4l2_set_fmt(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr)
@@ -413,6 +1041,49 @@ int v4l2_set_fmt(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr)
     return 0; 
 }
 
+/*
+ * 按目标帧率设置帧间隔, 并取得驱动实际使用的帧间隔. 
+ * 目标帧率为0时恢复打开设备时的帧间隔, 驱动不支持设置帧间隔时保持默认帧率
+ */
+static int v4l2_apply_fps(struct v4l2_dev *v)
+{
+    struct v4l2_streamparm parm;
+    struct v4l2_fract *tpf = &parm.parm.capture.timeperframe;
+
+    bzero(&parm, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(v->fd, VIDIOC_G_PARM, &parm)) {
+        pr_debug("VIDIOC_G_PARM: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        v->ival = *tpf;
+        return 0;
+    }
+
+    if (v->fps) {
+        tpf->numerator   = 1;
+        tpf->denominator = v->fps;
+    } else if (v->def_ival.denominator && 
+               (tpf->numerator != v->def_ival.numerator || 
+                tpf->denominator != v->def_ival.denominator)) {
+        *tpf = v->def_ival;
+    } else {
+        v->ival = *tpf;
+        return 0;
+    }
+    /* 有的驱动采集中不能设置, 返回EBUSY */
+    if (-1 == xioctl(v->fd, VIDIOC_S_PARM, &parm)) {
+        if (errno != EBUSY)
+            perror("VIDIOC_S_PARM");
+        return -1;
+    }
+    v->ival = *tpf;
+    pr_debug("frame interval: %u/%u\n", v->ival.numerator, v->ival.denominator);
+    return 0;
+}
+
 __u32 v4l2_get_fmts_nr(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
@@ -456,6 +1127,66 @@ int v4l2_get_frmsize(v4l2_dev_t vd,
     return 0;
 }
 
+__u32 v4l2_get_frm_ivals_nr(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr)
+{
+	struct v4l2_dev *v = vd;
+    if (fmt_nr >= v->ffmts_nr || frm_nr >= v->ffmts[fmt_nr].frms_nr) 
+        return 0;
+    return v->ffmts[fmt_nr].ivals[frm_nr].nr;
+}
+
+int v4l2_get_frm_ival(v4l2_dev_t vd, 
+                      __u32 fmt_nr, __u32 frm_nr, __u32 ival_nr,
+                      struct v4l2_frmivalenum *ival)
+{
+	struct v4l2_dev *v = vd;
+    if (ival_nr >= v4l2_get_frm_ivals_nr(vd, fmt_nr, frm_nr)) {
+        pr_debug("invalid arguments: fmt_nr = %u, frm_nr = %u, ival_nr = %u\n",
+                  fmt_nr, frm_nr, ival_nr);
+        return -1;
+    }
+    memcpy(ival, &v->ffmts[fmt_nr].ivals[frm_nr].ivals[ival_nr], 
+           sizeof(struct v4l2_frmivalenum));
+    return 0;
+}
+
+/*
+ * 目标帧率及驱动实际使用的帧间隔, 驱动不支持时帧间隔为0/0
+ */
+__u32 v4l2_get_fps(v4l2_dev_t vd, struct v4l2_fract *ival)
+{
+	struct v4l2_dev *v = vd;
+    if (ival)
+        *ival = v->ival;
+    return v->fps;
+}
+
+/*
+ * 采集缓冲区个数及其中被img_proc持有的个数
+ */
+__u32 v4l2_get_buf_nr(v4l2_dev_t vd, __u32 *held)
+{
+	struct v4l2_dev *v = vd;
+    if (held)
+        *held = v->buf_held;
+    return v->buf_nr;
+}
+
+/*
+ * 重新开始采集前必须送回的缓冲区个数, 为0时v4l2_switch_fmt和
+ * v4l2_set_fps不会因为缓冲区被持有返回EBUSY
+ */
+__u32 v4l2_get_busy_buf_nr(v4l2_dev_t vd)
+{
+	struct v4l2_dev *v = vd;
+    __u32 nr;
+
+    pthread_mutex_lock(&v->buf_mutex);
+    nr = v->old_held + (v->orphan_ok ? 0 : v->buf_held);
+    pthread_mutex_unlock(&v->buf_mutex);
+    return nr;
+}
+
 __u32 v4l2_get_cur_fmt_nr(v4l2_dev_t vd)
 {
 	struct v4l2_dev *v = vd;
@@ -513,12 +1244,16 @@ static int v4l2_init(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr)
 
 	if (-1 == v4l2_uctl_setup(v)) 
 		return -1;
+    v4l2_ext_ctrls_probe(v);
 
 	if (-1 == v4l2_fmt_setup(v)) 
 		goto err_uctl;	
 
 	if (-1 == v4l2_set_fmt(v, fmt_nr, frm_nr)) 
 		goto err_fmt;	
+    /* 此时还没有设置目标帧率, 取得的就是驱动默认的帧间隔 */
+    v4l2_apply_fps(v);
+    v->def_ival = v->ival;
 	
 	if (-1 == v4l2_mmap_setup(v)) 
 		goto err_fmt;	
@@ -545,29 +1280,114 @@ static void v4l2_app_handler(int fd, void *arg)
 {
 	struct v4l2_dev *v = arg;
 	struct v4l2_buffer buf;
+    int ret = V4L2_BUF_DONE;
 
     if (fd != v->fd) {
         pr_debug("fd = %d, v->fd = %d.\n", fd, v->fd);
         return;
     }
 
+    memset(&buf, 0, sizeof(buf));
     buf.type   = v->ffmts[v->cur_fmt].fmt.type;
     buf.memory = V4L2_MEMORY_MMAP;	
     /* 从队列中取出一个buf */
     if (-1 == xioctl(v->fd, VIDIOC_DQBUF, &buf)) {
-        perror("VIDIOC_STREAMOFF");
+        if (errno == EAGAIN)
+            return;
+        perror("VIDIOC_DQBUF");
         exit(EXIT_FAILURE);
     }	
 
+    /* 回调中可能已在其他线程调用v4l2_put_buf, 所以先计入持有数 */
+    pthread_mutex_lock(&v->buf_mutex);
+    v->buf_held++;
+    v->buf[buf.index].held = true;
+    pthread_mutex_unlock(&v->buf_mutex);
+
     /* 执行回调函数 */
     if (v->proc)
-        v->proc(v->buf[buf.index].start, buf.bytesused, v->arg);
+        ret = v->proc(v->buf[buf.index].start, buf.bytesused, v->arg);
+
+    pthread_mutex_lock(&v->buf_mutex);
+    if (ret == V4L2_BUF_HOLD) {
+        /* 
+         * 所有缓冲区都被持有时驱动队列为空, poll会一直返回POLLERR,
+         * 先移出epoll, 等v4l2_put_buf送回缓冲区后再加入
+         */
+        if (v->buf_held == v->buf_nr)
+            app_del_event(v->app, v->ev);
+        pthread_mutex_unlock(&v->buf_mutex);
+        return;
+    }
 
     /* 送回队列 */
+    v->buf_held--;
+    v->buf[buf.index].held = false;
     if (-1 == xioctl(v->fd, VIDIOC_QBUF, &buf)) {
-        perror("VIDIOC_STREAMOFF");
+        perror("VIDIOC_QBUF");
         exit(EXIT_FAILURE);
     }	
+    pthread_mutex_unlock(&v->buf_mutex);
+}
+
+/*
+ * 送回切换格式前的缓冲区, 直接munmap, 全部送回后才能再次切换. 
+ * 调用者持有buf_mutex
+ */
+static void v4l2_put_old_buf(struct v4l2_dev *v, const void *p)
+{
+    int i;
+
+    for (i = 0; i < v->old_nr; i++) {
+        if (v->old_buf[i].start == p)
+            break;
+    }
+    if (i == v->old_nr) {
+        pr_debug("invalid buffer: %p\n", p);
+        return;
+    }
+
+    munmap(v->old_buf[i].start, v->old_buf[i].len);
+    v->old_buf[i].start = NULL;
+    if (--v->old_held == 0) {
+        free(v->old_buf);
+        v->old_buf = NULL;
+        v->old_nr  = 0;
+    }
+}
+
+/*
+ * 将img_proc返回V4L2_BUF_HOLD持有的缓冲区送回驱动, 可以在其他线程中调用
+ */
+void v4l2_put_buf(v4l2_dev_t vd, const void *p)
+{
+	struct v4l2_dev *v = vd;
+	struct v4l2_buffer buf;
+    int i;
+
+    /* 切换格式时会替换buf, 查找也要加锁 */
+    pthread_mutex_lock(&v->buf_mutex);
+    for (i = 0; i < v->buf_nr; i++) {
+        if (v->buf[i].start == p)
+            break;
+    }
+    if (i == v->buf_nr) {
+        v4l2_put_old_buf(v, p);
+        pthread_mutex_unlock(&v->buf_mutex);
+        return;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type   = v->ffmts[v->cur_fmt].fmt.type;
+    buf.memory = V4L2_MEMORY_MMAP;	
+    buf.index  = i;
+
+    v->buf[i].held = false;
+    if (-1 == xioctl(v->fd, VIDIOC_QBUF, &buf)) 
+        perror("VIDIOC_QBUF");
+    if (v->buf_held-- == v->buf_nr)
+        app_add_event(v->app, v->ev);
+    pthread_mutex_unlock(&v->buf_mutex);
 }
 
 v4l2_dev_t v4l2_create(app_t app, const char *dev, __u32 fmt_nr, __u32 frm_nr) 
@@ -589,13 +1409,22 @@ v4l2_dev_t v4l2_create(app_t app, const char *dev, __u32 fmt_nr, __u32 frm_nr)
     if (-1 == (v4l2_init(v, fmt_nr, frm_nr))) 
         goto err_open;
 
+    if (pthread_mutex_init(&v->buf_mutex, NULL)) {
+        perror("v4l2_create: pthread_mutex_init");
+        goto err_init;
+    }
+
     v->ev = app_event_create(v->fd);
     if (NULL == v->ev) 
-        goto err_init;
+        goto err_mutex;
     app_event_add_notifier(v->ev, NOTIFIER_READ, v4l2_app_handler, v);
+    if (v->uctl_cached)
+        app_event_add_notifier(v->ev, NOTIFIER_PRI, v4l2_event_handler, v);
     v->app = app;
 
 	return v;
+err_mutex:
+    pthread_mutex_destroy(&v->buf_mutex);
 err_init:
     v4l2_uninit(v);
 err_open:
@@ -611,6 +1440,7 @@ void v4l2_free(v4l2_dev_t vd)
     v4l2_uninit(v);
     close(v->fd);
     app_event_free(v->ev);
+    pthread_mutex_destroy(&v->buf_mutex);
     free(v);
 }
 
@@ -655,6 +1485,7 @@ int v4l2_start_capture(v4l2_dev_t vd)
         perror("VIDIOC_STREAMON");
         return -1;
     }	
+    v->streaming = true;
 
     return app_add_event(v->app, v->ev);  
 }
@@ -668,9 +1499,154 @@ int v4l2_stop_capture(v4l2_dev_t vd)
         perror("VIDIOC_STREAMOFF");
         return -1;
     }	
+    v->streaming = false;
 	return app_del_event(v->app, v->ev);
 }
 
+/*
+ * 重新开始采集, 不需要重新打开设备:
+ * STREAMOFF -> 释放缓冲区(REQBUFS 0) -> S_FMT/S_PARM -> 重新mmap -> STREAMON.
+ * 只能在采集线程中调用, 失败时恢复原来的格式和帧率.
+ *
+ * 仍被img_proc持有的缓冲区留在old_buf中, 送回时才munmap, 
+ * 驱动不支持释放仍被映射的缓冲区时, 或上次切换的缓冲区还没全部送回时, 
+ * 返回-1, errno为EBUSY, 调用者应先送回缓冲区或稍后重试
+ */
+static int v4l2_restream(struct v4l2_dev *v, __u32 fmt_nr, __u32 frm_nr, 
+                         __u32 fps)
+{
+    __u32 old_fmt = v->cur_fmt;
+    __u32 old_frm = v->cur_frm;
+    __u32 old_fps = v->fps;
+    bool streaming = v->streaming;
+    __u32 count;
+    int i, err;
+
+    pthread_mutex_lock(&v->buf_mutex);
+    if (v->old_buf || (v->buf_held && !v->orphan_ok)) {
+        pthread_mutex_unlock(&v->buf_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (streaming && v4l2_stop_capture(v)) {
+        err = errno;
+        goto err_unlock;
+    }
+
+    /* 没有被持有的缓冲区马上munmap, 持有的由v4l2_put_buf送回时munmap */
+    for (i = 0; i < v->buf_nr; i++) {
+        if (v->buf[i].held) 
+            continue;
+        munmap(v->buf[i].start, v->buf[i].len);
+        v->buf[i].start = NULL;
+    }
+    if (v->buf_held) {
+        v->old_buf  = v->buf;
+        v->old_nr   = v->buf_nr;
+        v->old_held = v->buf_held;
+    } else {
+        free(v->buf);
+    }
+    v->buf      = NULL;
+    v->buf_nr   = 0;
+    v->buf_held = 0;
+
+    count = 0;
+    if (-1 == v4l2_reqbufs(v, &count)) {
+        err = errno;
+        goto err_restore;
+    }
+
+    if (-1 == v4l2_set_fmt(v, fmt_nr, frm_nr)) {
+        err = errno;
+        goto err_restore;
+    }
+    /* S_FMT可能把帧率恢复成默认值; 只切换格式时帧率设置失败不算失败 */
+    v->fps = fps;
+    if (-1 == v4l2_apply_fps(v) && fps != old_fps) {
+        err = errno;
+        goto err_restore;
+    }
+
+    if (-1 == v4l2_mmap_setup(v)) {
+        err = errno;
+        goto err_restore;
+    }
+
+    if (streaming && v4l2_start_capture(v)) {
+        err = errno;
+        goto err_restore;
+    }
+    pthread_mutex_unlock(&v->buf_mutex);
+    pr_debug("switch to format %u, frame size %u\n", fmt_nr, frm_nr);
+    return 0;
+
+err_restore:
+    v->fps = old_fps;
+    if (v->buf) {
+        for (i = 0; i < v->buf_nr; i++) 
+            munmap(v->buf[i].start, v->buf[i].len);
+        free(v->buf);
+        v->buf    = NULL;
+        v->buf_nr = 0;
+        count = 0;
+        v4l2_reqbufs(v, &count);
+    }
+    if (0 == v4l2_set_fmt(v, old_fmt, old_frm)) {
+        v4l2_apply_fps(v);
+        if (0 == v4l2_mmap_setup(v) && (!streaming || 0 == v4l2_start_capture(v)))
+            goto err_unlock;
+    }
+    pr_debug("failed to restore format %u, frame size %u\n", old_fmt, old_frm);
+err_unlock:
+    pthread_mutex_unlock(&v->buf_mutex);
+    errno = err;
+    return -1;
+}
+
+/*
+ * 采集中切换像素格式和帧大小, 见v4l2_restream
+ */
+int v4l2_switch_fmt(v4l2_dev_t vd, __u32 fmt_nr, __u32 frm_nr)
+{
+	struct v4l2_dev *v = vd;
+
+    if (fmt_nr >= v->ffmts_nr || frm_nr >= v->ffmts[fmt_nr].frms_nr) {
+        pr_debug("invalid arguments: fmt_nr = %u(max: %u), frm_nr = %u\n",
+                  fmt_nr, v->ffmts_nr, frm_nr);
+        errno = EINVAL;
+        return -1;
+    }
+    if (fmt_nr == v->cur_fmt && frm_nr == v->cur_frm)
+        return 0;
+    return v4l2_restream(v, fmt_nr, frm_nr, v->fps);
+}
+
+/*
+ * 设置目标帧率, fps为0时恢复打开设备时驱动默认的帧间隔. 
+ * 驱动在采集中不允许设置帧率时(如uvc)重新开始采集, 
+ * 这时只能在采集线程中调用, 返回值同v4l2_restream. 
+ * 失败时v4l2_get_fps仍返回原来的帧率
+ */
+int v4l2_set_fps(v4l2_dev_t vd, __u32 fps)
+{
+	struct v4l2_dev *v = vd;
+    __u32 old_fps = v->fps;
+    int err;
+
+    v->fps = fps;
+    if (v4l2_apply_fps(v) == 0)
+        return 0;
+    err = errno;
+    v->fps = old_fps;
+    if (err != EBUSY || !v->streaming) {
+        errno = err;
+        return -1;
+    }
+    return v4l2_restream(v, v->cur_fmt, v->cur_frm, fps);
+}
+
 #if 0
 int main(int argc, char *argv[])
 {
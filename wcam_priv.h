@@ -4,10 +4,12 @@
 #include <sys/types.h>
 
 #include <cam/wcs.h>
+#include <cam/list.h>
 
 #include <cam/request.h>
 
 #include <cam/threadpool.h>
+#include <cam/bufpool.h>
 #include <cam/tcp_srv.h>
 #include <cam/utils.h>
 #include <cam/cfg.h>
@@ -16,46 +18,81 @@
 #include <cam/fbd.h>
 
 #if defined(VID_FUNC)
-#define VID_FRAME_MAX_SZ    (0xFFFFF - FRAME_MAX_SZ)
 typedef struct vid *vid_t;
 
 vid_t vid_create(struct wcamsrv *ws);
 void vid_free(vid_t vid);
+void vid_cli_uninit(vid_t vid, tcpc_t c);
+void vid_cli_drain(vid_t vid, tcpc_t c);
 
 int vid_cmd_proc(tcpc_t c);
 #endif
 
+#if defined(SYS_FUNC)
+int sys_cmd_proc(tcpc_t c);
+#endif
+
 struct wcamsrv {
-    app_t                   app;
+    app_group_t             grp;
+    app_t                   app;            /* grp中的第0个app, 负责采集 */
     thread_pool_t           pool;
 
 #if defined(VID_FUNC)
     vid_t                   vid;
 #endif
 
-    tcp_srv_t               srv;
+    tcp_srv_t               *srv;           /* 每个app一个或只有一个 */
+    int                     srv_nr;
     cfg_t                   cfg;
 };
 
+/* 
+ * 接收缓冲区大小, 一次recv读入尽可能多的请求, 至少要能放下一个最大的帧 
+ */
+#define WCAM_RX_BUF_SZ      4096
+
+/* 
+ * 帧头最大长度, 足够放下扩展帧头或通用帧头加4字节数据大小, 
+ * 取4的倍数使其后的数据对齐
+ */
+#define FRAME_HDR_MAX       ((FRAME_EXT_HDR_SZ + 3) & ~3)
+
+/*
+ * 每个连接的私有数据, 应答不在此缓存, 而是复制或引用到发送队列中
+ */
 struct wcamcli {
-    int         req_total;
-    int         req_cnt;
-    __u8        req[FRAME_MAX_SZ];
+    __u8        *req;                   /* 正在处理的请求帧, 指向接收缓冲区中 */
+    __u8        *req_dat;               /* 请求帧的数据字段 */
+    __u32       req_len;                /* 请求帧的数据字段长度 */
+    __u32       req_seq;                /* 扩展帧请求的序号, 由同步应答带回 */
+    int         rx_len;                 /* rx_buf中未处理的字节数 */
+    __u8        *rx_buf;                /* 有不完整的帧时才从bufp分配, 处理完放回 */
+
+    int         proto;                  /* 协商的协议版本, PROTO_VER_xxx */
+    __u32       tx_seq;                 /* 服务器主动发送的扩展帧序号 */
 #if defined(VID_FUNC)
-    __u8        rsp[FRAME_MAX_SZ + VID_FRAME_MAX_SZ];
     __u64       last_frm_index;
-#else
-    __u8        rsp[FRAME_MAX_SZ];
+
+    /* 订阅推送 */
+    struct list_head sub_entry;
+    __u32       sub_interval_ms;        /* 最小推送间隔 */
+    __u8        sub_flags;
+    __u64       last_push_ms;
+    struct vid_frm *pending_frm;        /* 发送队列未发完时到达的最新帧 */
+    __u32       frm_skipped;            /* 未发送给该客户端的帧数 */
 #endif
    
     wcs_t       srv;
+    tcpc_t      cli;
 };
 
 void build_and_send_rsp(tcpc_t c, __u8 type, __u8 id, 
                         __u8 len, __u8 *data);
 
-int build_rsp(__u8 *rsp, __u8 type, __u8 id, 
-                        __u8 len, __u8 *data);
+int build_hdr(tcpc_t c, __u8 *hdr, __u8 type, __u8 id, __u32 len);
+int build_large_hdr(tcpc_t c, __u8 *hdr, __u8 type, __u8 id, __u32 size);
+void build_and_send_large_rsp(tcpc_t c, __u8 type, __u8 id, 
+                              __u8 *buf, __u32 size);
 
 #endif
 
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "wcam_priv.h"
 
@@ -42,46 +43,95 @@ static tcpc_handler_t process_incomings[] = {
 };
 
 #if defined(DBG_WCAM)
-static void print_frame(__u8 *req)
+static void print_frame(__u8 *hdr, __u8 *dat, __u32 len)
 {
-    int i;
-    int len = req[LEN_POS];
+    __u32 i;
     pr_debug("print_frame:\n");
-    pr_debug("len : %02x\n", len);
-    pr_debug("cmd0: %02x\n", req[CMD0_POS]);
-    pr_debug("cmd1: %02x\n", req[CMD1_POS]);
+    pr_debug("len : %u%s\n", len, 
+             hdr[LEN_POS] == FRAME_EXT_LEN ? " (ext)" : "");
+    pr_debug("cmd0: %02x\n", hdr[CMD0_POS]);
+    pr_debug("cmd1: %02x\n", hdr[CMD1_POS]);
     pr_debug("dat : ");
-    for (i = 0; i < len; i++) 
-        printf("%02x ", req[DAT_POS + i]); 
+    for (i = 0; i < len && i < FRAME_DAT_MAX; i++) 
+        printf("%02x ", dat[i]); 
     printf("\n");
 }
 #else
-#define print_frame(req) do {} while(0)
+#define print_frame(hdr, dat, len) do {} while(0)
 #endif
 
-int build_rsp(__u8 *rsp, __u8 type, __u8 id, 
-                         __u8 len, __u8 *data)
+/*
+ * 构造帧头, 返回帧头长度, len为之后数据的长度. 
+ * 连接协商使用扩展帧后构造扩展帧头, 同步应答带回请求的序号, 
+ * 否则构造通用帧头, 此时len不能超过FRAME_DAT_MAX
+ */
+int build_hdr(tcpc_t c, __u8 *hdr, __u8 type, __u8 id, __u32 len)
+{
+    struct wcamcli *wc = c->arg;
+    __u32 seq;
+
+    hdr[CMD0_POS] = type;
+    hdr[CMD1_POS] = id;
+    if (wc->proto < PROTO_VER_EXT) {
+        hdr[LEN_POS] = len;
+        return FRAME_HDR_SZ;
+    }
+
+    if (((type & TYPE_MASK) >> TYPE_BIT_POS) == TYPE_SRSP) 
+        seq = wc->req_seq;
+    else    /* 推送可能在其他线程中发出 */
+        seq = __sync_add_and_fetch(&wc->tx_seq, 1);
+    hdr[LEN_POS] = FRAME_EXT_LEN;
+    memcpy(&hdr[EXT_LEN_POS], &len, sizeof(__u32));
+    memcpy(&hdr[EXT_SEQ_POS], &seq, sizeof(__u32));
+    return FRAME_EXT_HDR_SZ;
+}
+
+/*
+ * 构造数据可能超过FRAME_DAT_MAX的帧头, 返回帧头长度, 之后紧跟size字节数据. 
+ * 扩展帧的数据长度就是size, 通用帧则在帧头后附加4字节的size作为数据, 
+ * hdr至少要有FRAME_HDR_MAX字节
+ */
+int build_large_hdr(tcpc_t c, __u8 *hdr, __u8 type, __u8 id, __u32 size)
+{
+    struct wcamcli *wc = c->arg;
+    int n;
+
+    if (wc->proto >= PROTO_VER_EXT)
+        return build_hdr(c, hdr, type, id, size);
+
+    n = build_hdr(c, hdr, type, id, sizeof(__u32));
+    memcpy(&hdr[n], &size, sizeof(__u32));
+    return n + sizeof(__u32);
+}
+
+/*
+ * 发送数据可能超过FRAME_DAT_MAX的应答, buf由bufp_alloc分配, 
+ * 前FRAME_HDR_MAX字节留给帧头, 之后是size字节数据, 
+ * buf不复制, 发送完后释放
+ */
+void build_and_send_large_rsp(tcpc_t c, __u8 type, __u8 id, 
+                              __u8 *buf, __u32 size)
 {
-    rsp[LEN_POS]  = len;
-    rsp[CMD0_POS] = type;
-    rsp[CMD1_POS] = id;
-    memcpy(&rsp[DAT_POS], data, len);
-    print_frame(rsp);
-    return len + FRAME_HDR_SZ;
+    __u8  hdr[FRAME_HDR_MAX];
+    int   n, pos;
+
+    n   = build_large_hdr(c, hdr, type, id, size);
+    pos = FRAME_HDR_MAX - n;
+    memcpy(&buf[pos], hdr, n);
+    tcpc_send_ref(c, &buf[pos], n + size, bufp_put, buf);
 }
 
 void build_and_send_rsp(tcpc_t c, __u8 type, __u8 id, 
                         __u8 len, __u8 *data)
 {
-    struct wcamcli  *wc   = c->arg;
-    __u8  *rsp = wc->rsp;
+    __u8  rsp[FRAME_EXT_HDR_SZ + FRAME_DAT_MAX];
+    int   n;
 
-    rsp[LEN_POS]  = len;
-    rsp[CMD0_POS] = type;
-    rsp[CMD1_POS] = id;
-    memcpy(&rsp[DAT_POS], data, len);
-    print_frame(rsp);
-    tcpc_send(c, rsp, len + FRAME_HDR_SZ);
+    n = build_hdr(c, rsp, type, id, len);
+    memcpy(&rsp[n], data, len);
+    print_frame(rsp, &rsp[n], len);
+    tcpc_send(c, rsp, n + len);
 }
 
 static void process_incoming(tcpc_t c) 
@@ -94,9 +144,9 @@ static void process_incoming(tcpc_t c)
     rsp[1] = req[CMD0_POS];
     rsp[2] = req[CMD1_POS];
 
-    print_frame(req);
+    print_frame(req, wc->req_dat, wc->req_len);
 
-    if (req[LEN_POS] > FRAME_DAT_MAX) {
+    if (req[LEN_POS] != FRAME_EXT_LEN && wc->req_len > FRAME_DAT_MAX) {
         rsp[0] = ERR_LEN;
     } else if ((rsp[1] & SUBS_MASK) < SUBS_MAX) {
         func = process_incomings[rsp[1] & SUBS_MASK];
@@ -108,31 +158,89 @@ static void process_incoming(tcpc_t c)
         rsp[0] = ERR_SUBS;
     }
     
-    if ((rsp[0] != ERR_SUCCESS) && ((rsp[1] & TYPE_MASK) == TYPE_SREQ)) {
+    /* 
+     * 同步请求出错时客户端在等应答, 回复错误帧, 
+     * build_hdr使扩展帧的错误应答带回请求的序号
+     */
+    if ((rsp[0] != ERR_SUCCESS) && 
+        (((rsp[1] & TYPE_MASK) >> TYPE_BIT_POS) == TYPE_SREQ)) {
         build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_ERR, 
                            0, FRAME_ERR_SZ, rsp);
     }
 }
 
+/*
+ * 一次recv读入缓冲区剩余空间, 处理其中所有完整的帧, 客户端可以在一个数据包中
+ * 连续发送多个请求. 通常请求都是完整到达的, 所以先读到栈上的缓冲区, 
+ * 只有留下不完整的帧时才从bufp分配rx_buf保存, 帧处理完后放回, 
+ * 空闲连接不占用接收缓冲区
+ */
 static int cli_handler(tcpc_t c) 
 {
     struct wcamcli  *wc   = c->arg;
-    int             res;
-    __u8            *pbuf;
-    
-    pbuf  = &wc->req[wc->req_cnt]; 
-
-    res = read(c->sock, pbuf, wc->req_total - wc->req_cnt);
-    if (res > 0) {
-        wc->req_cnt += res;
-        if (wc->req_cnt == FRAME_HDR_SZ) {
-            wc->req_total += wc->req[LEN_POS];
-        } 
-        if (wc->req_cnt == wc->req_total) {
-            process_incoming(c);
-            wc->req_total = FRAME_HDR_SZ;
-            wc->req_cnt   = 0;
+    int             res, space, pos, hdr_len;
+    __u32           dat_len;
+    __u8            *buf, *p;
+    __u8            stk_buf[WCAM_RX_BUF_SZ];
+
+    buf = wc->rx_buf ? wc->rx_buf : stk_buf;
+    space = WCAM_RX_BUF_SZ - wc->rx_len;
+    res = recv(c->sock, &buf[wc->rx_len], space, 0);
+    if (res <= 0)
+        return res;
+    wc->rx_len += res;
+
+    pos = 0;
+    while (wc->rx_len - pos >= FRAME_HDR_SZ) {
+        p = &buf[pos];
+        if (wc->proto >= PROTO_VER_EXT && p[LEN_POS] == FRAME_EXT_LEN) {
+            if (wc->rx_len - pos < FRAME_EXT_HDR_SZ)
+                break;
+            memcpy(&dat_len, &p[EXT_LEN_POS], sizeof(__u32));
+            if (dat_len > WCAM_RX_BUF_SZ - FRAME_EXT_HDR_SZ) {
+                /* 放不进接收缓冲区的请求无法处理, 关闭连接 */
+                errno = EMSGSIZE;
+                return -1;
+            }
+            memcpy(&wc->req_seq, &p[EXT_SEQ_POS], sizeof(__u32));
+            hdr_len = FRAME_EXT_HDR_SZ;
+        } else {
+            dat_len = p[LEN_POS];
+            wc->req_seq = 0;
+            hdr_len = FRAME_HDR_SZ;
         }
+        if (wc->rx_len - pos < hdr_len + dat_len)
+            break;
+        wc->req     = p;
+        wc->req_dat = p + hdr_len;
+        wc->req_len = dat_len;
+        process_incoming(c);
+        pos += hdr_len + dat_len;
+    }
+    wc->req = NULL;
+
+    wc->rx_len -= pos;
+    if (wc->rx_len == 0) {
+        if (wc->rx_buf) {
+            bufp_put(wc->rx_buf);
+            wc->rx_buf = NULL;
+        }
+    } else if (!wc->rx_buf) {
+        wc->rx_buf = bufp_alloc(WCAM_RX_BUF_SZ);
+        if (!wc->rx_buf)
+            return -1;
+        memcpy(wc->rx_buf, &buf[pos], wc->rx_len);
+    } else if (pos > 0) {
+        memmove(wc->rx_buf, &wc->rx_buf[pos], wc->rx_len);
+    }
+
+    /* 
+     * 没有读满说明套接字接收缓冲区已空, 边沿触发下不必再调用recv确认,
+     * 以EAGAIN结束本次读取
+     */
+    if (res < space) {
+        errno = EAGAIN;
+        return -1;
     }
     return res;
 }
@@ -146,7 +254,11 @@ static int cli_init(tcpc_t c, void *arg)
 	}
     pr_debug("wc->srv = %p\n", arg);
     wc->srv = arg;
-    wc->req_total = FRAME_HDR_SZ;
+    wc->cli = c;
+    wc->proto = PROTO_VER_BASE;
+#if defined(VID_FUNC)
+    INIT_LIST_HEAD(&wc->sub_entry);
+#endif
     c->arg = wc;
     return 0;
 }
@@ -154,34 +266,81 @@ static int cli_init(tcpc_t c, void *arg)
 static void cli_uninit(tcpc_t c)
 {
     struct wcamcli *wc = c->arg;
+#if defined(VID_FUNC)
+    vid_cli_uninit(wc->srv->vid, c);
+#endif
+    if (wc->rx_buf)
+        bufp_put(wc->rx_buf);
     free(wc);
 }
 
+#if defined(VID_FUNC)
+static void cli_drain(tcpc_t c)
+{
+    struct wcamcli *wc = c->arg;
+    vid_cli_drain(wc->srv->vid, c);
+}
+#endif
+
+static void wcs_srv_free(struct wcamsrv* ws) 
+{
+    int i;
+    for (i = 0; i < ws->srv_nr; i++)
+        tcps_free(ws->srv[i]);
+    free(ws->srv);
+}
+
+/*
+ * listen_reuseport打开时每个app各监听一次同一端口, 由内核分配新连接,
+ * 否则只在第0个app中监听, 再把客户端分派到组内各app
+ */
 static int wcs_srv_init(struct wcamsrv* ws)
 {
-    ws->srv = tcps_create(ws->app, cfg_get_srvport(ws->cfg));
-    if (ws->srv == NULL)
+    int reuseport = cfg_get_listen_reuseport(ws->cfg);
+    int app_nr = app_group_get_nr(ws->grp);
+    /* 有多个app时第0个只负责采集, 不在其上监听 */
+    int first = (reuseport && app_nr > 1) ? 1 : 0;
+    int nr = reuseport ? app_nr - first : 1;
+    tcp_srv_t srv;
+
+    ws->srv = calloc(nr, sizeof(tcp_srv_t));
+    if (!ws->srv) {
+        perror("wcs_srv_init");
         return -1;
+    }
 
-    if (cfg_get_cli_timeout(ws->cfg) > 0)
-        tcps_set_timeout(ws->srv, cfg_get_cli_timeout(ws->cfg));
+    for (ws->srv_nr = 0; ws->srv_nr < nr; ws->srv_nr++) {
+        srv = tcps_create(app_group_get(ws->grp, first + ws->srv_nr), 
+                          cfg_get_srvport(ws->cfg),
+                          cfg_get_listen_backlog(ws->cfg), reuseport);
+        if (srv == NULL)
+            goto err_srv;
 
-    if (cfg_get_cli_timeout_check(ws->cfg) > 0)
-        tcps_set_timeout_check(ws->srv, cfg_get_cli_timeout_check(ws->cfg));
+        if (cfg_get_cli_timeout(ws->cfg) > 0)
+            tcps_set_timeout(srv, cfg_get_cli_timeout(ws->cfg));
 
-    tcps_set_cli_init(ws->srv, cli_init, ws);
-    tcps_set_cli_uninit(ws->srv, cli_uninit);
-    tcps_set_cli_recvhandler(ws->srv, cli_handler);
-    return 0;
-}
+        if (!reuseport && app_group_get_nr(ws->grp) > 1)
+            tcps_set_cli_apps(srv, ws->grp);
 
-static inline void wcs_srv_free(struct wcamsrv* ws) {
-    tcps_free(ws->srv);
+        tcps_set_cli_init(srv, cli_init, ws);
+        tcps_set_cli_uninit(srv, cli_uninit);
+        tcps_set_cli_recvhandler(srv, cli_handler);
+#if defined(VID_FUNC)
+        tcps_set_cli_drainhandler(srv, cli_drain);
+#endif
+        ws->srv[ws->srv_nr] = srv;
+    }
+    return 0;
+err_srv:
+    wcs_srv_free(ws);
+    return -1;
 }
 
 wcs_t wcs_create(char *cfg_path) 
 {
     struct wcamsrv *ws = calloc(1, sizeof(struct wcamsrv));
+    int i;
+
     if (!ws) {
 		perror("wcs_create");
 		return NULL;
@@ -191,11 +350,26 @@ wcs_t wcs_create(char *cfg_path)
     if (ws->cfg == NULL)
         goto err_mem;
 
-    ws->app = app_create(cfg_get_max_app_event(ws->cfg));
-    if (ws->app == NULL)
+    ws->grp = app_group_create(cfg_get_app_in_group(ws->cfg),
+                               cfg_get_max_app_event(ws->cfg));
+    if (ws->grp == NULL)
         goto err_cfg;
+    ws->app = app_group_get(ws->grp, 0);
+    for (i = 1; i < app_group_get_nr(ws->grp); i++) 
+        app_set_sched(app_group_get(ws->grp, i), 
+                      cfg_get_thread_sched(ws->cfg, THREAD_REACTOR));
+#if defined(VID_FUNC)
+    /* 采集在第一个事件循环中进行 */
+    app_set_sched(ws->app, cfg_get_thread_sched(ws->cfg, THREAD_CAPTURE));
+#else
+    app_set_sched(ws->app, cfg_get_thread_sched(ws->cfg, THREAD_REACTOR));
+#endif
 
-    ws->pool = pool_create(cfg_get_thread_in_pool(ws->cfg));
+    ws->pool = pool_create(cfg_get_thread_in_pool(ws->cfg),
+                           cfg_get_pool_queue_len(ws->cfg),
+                           cfg_get_pool_policy(ws->cfg),
+                           cfg_get_pool_stack_size(ws->cfg),
+                           cfg_get_thread_sched(ws->cfg, THREAD_POOL));
     if (ws->pool == NULL)
         goto err_app;
 
@@ -216,7 +390,7 @@ err_cam:
 err_pool:
     pool_free(ws->pool);
 err_app:
-    app_free(ws->app);
+    app_group_free(ws->grp);
 err_cfg:
     cfg_free(ws->cfg);
 err_mem:
@@ -232,7 +406,7 @@ void wcs_free(wcs_t wcs)
     vid_free(ws->vid);
 #endif
     pool_free(ws->pool);
-    app_free(ws->app);
+    app_group_free(ws->grp);
     cfg_free(ws->cfg);
     free(ws);
 }
@@ -240,7 +414,7 @@ void wcs_free(wcs_t wcs)
 int wcs_run(wcs_t wcs) 
 {
     struct wcamsrv *ws = wcs;
-    return app_exec(ws->app);
+    return app_group_exec(ws->grp);
 }
 
 #if 1
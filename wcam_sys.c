@@ -0,0 +1,91 @@
+#if defined (SYS_FUNC)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "wcam_priv.h"
+
+#if defined(DBG_SYS)
+#define pr_debug(fmt, ...) \
+    printf("[%s][%d]" fmt, __func__, __LINE__, ##__VA_ARGS__)
+#else
+#define pr_debug(fmt, ...) \
+    do {} while(0)
+#endif
+
+/*
+ * 协商协议版本, 取客户端支持的最高版本与服务器支持的最高版本中较小的一个.
+ * 应答按协商前的帧格式发出, 之后服务器发出的帧都使用新的格式
+ */
+static void sys_set_proto(tcpc_t c, __u8 id, __u8 ver)
+{
+    struct wcamcli *wc = c->arg;
+
+    if (ver > PROTO_VER_MAX)
+        ver = PROTO_VER_MAX;
+    if (ver < PROTO_VER_BASE)
+        ver = PROTO_VER_BASE;
+
+    build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_SYS, id, 1, &ver);
+    wc->proto = ver;
+    pr_debug("client(sock: %d) use protocol version %d\n", c->sock, ver);
+}
+
+static void sys_get_pool_stats(struct wcamcli *wc, __u8 *rsp)
+{
+    struct pool_stats st;
+    struct sys_pool_stats ps;
+
+    pool_get_stats(wc->srv->pool, &st);
+    ps.capacity = st.capacity;
+    ps.depth    = st.depth;
+    ps.dropped  = st.dropped;
+    ps.rejected = st.rejected;
+    memcpy(rsp, &ps, sizeof(ps));
+}
+
+int sys_cmd_proc(tcpc_t c)
+{
+    struct wcamcli  *wc     = c->arg;
+    __u8            id      = wc->req[CMD1_POS];
+    __u8            status  = ERR_SUCCESS;
+    char            *ver;
+    int             len;
+    __u8            dat[sizeof(struct sys_pool_stats)];
+
+    switch (id) {
+    case REQUEST_ID(SYS_VERSION):
+        ver = cfg_get_version(wc->srv->cfg);
+        len = strlen(ver);
+        if (len > FRAME_DAT_MAX)
+            len = FRAME_DAT_MAX;
+        build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_SYS,
+                           id, len, (__u8*)ver);
+        break;
+
+    case REQUEST_ID(SYS_SET_PROTO):
+        if (wc->req_len < REQUEST_LEN(SYS_SET_PROTO)) {
+            status = ERR_PARAM;
+            break;
+        }
+        sys_set_proto(c, id, wc->req_dat[0]);
+        break;
+
+    case REQUEST_ID(SYS_POOL_STATS):
+        sys_get_pool_stats(wc, dat);
+        build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_SYS,
+                           id, sizeof(dat), dat);
+        break;
+
+    default:
+        status = ERR_CMD_ID;
+        break;
+    }
+
+    return status;
+}
+
+#endif
@@ -26,13 +26,68 @@ struct buf {
 	int             len;
 };
 
+/*
+ * 发布给客户端的图像帧, 发布后内容不再修改, 
+ * 各客户端发送时只增加引用计数, 最后一个引用释放时才回收:
+ * MJPEG帧的数据直接留在采集缓冲区中(cam不为NULL), 回收时送回驱动;
+ * 其他帧的数据在buf中, 与帧头一起从缓冲区池中分配
+ */
+struct vid_frm {
+    int                     ref;
+    int                     len;
+    __u64                   index;              /* 帧编号 */
+    __u8                    *data;
+    v4l2_dev_t              cam;                /* 持有的采集缓冲区所属设备 */
+    __u8                    buf[];
+};
+
+/*
+ * 序列化好的控制项列表, 控制项改变时才重新生成, 
+ * 各客户端的应答都引用它, 不复制 
+ */
+struct vid_blob {
+    __u8                    *data;
+    __u32                   size;
+    __u32                   ver;                /* 生成时v4l2_get_uctls_ver的值 */
+};
+
+#define VID_CAM_RESERVE         2               /* 驱动队列中至少保留的采集缓冲区数 */
+#define VID_FMT_RETRY_MAX       20              /* 连续多少次重试没有采集缓冲区送回时放弃切换 */
+#define VID_SUB_QUEUE_MAX       (1024*1024)     /* 推送时客户端最多积压的字节数 */
+
 struct vid {
     v4l2_dev_t              cam; 
-    struct buf              tran_frm;           /* frame to transfer */
-    __u32                   tran_frm_max_size;
+    struct vid_frm          *tran_frm;          /* frame to transfer */
     __u64                   tran_frm_index;     /* 帧编号 */
-    pthread_mutex_t         tran_frm_mutex;
-    struct buf              view_frm;           /* frame to preview */
+    pthread_mutex_t         tran_frm_mutex;     /* 只保护tran_frm指针的替换和引用 */
+    struct list_head        subs;               /* 订阅推送的客户端 */
+    pthread_mutex_t         sub_mutex;
+    struct vid_blob         uctls_blob;         /* VID_GET_UCTLS的旧列表 */
+    struct vid_blob         uctl_list_blob;     /* VID_GET_UCTL_LIST的完整列表 */
+    pthread_mutex_t         uctls_mutex;
+
+    /* 切换格式和帧率的请求, 由fmt_timer在采集线程中执行 */
+    struct app_timer        fmt_timer;
+    pthread_mutex_t         fmt_mutex;
+    __u32                   fmt_nr;
+    __u32                   frm_nr;
+    __u32                   fps;
+    int                     fmt_retry;
+    __u32                   fmt_busy;           /* 上次重试时还没送回的采集缓冲区数 */
+    bool                    fmt_wait;           /* 缓冲区全部送回前不再尝试切换 */
+    bool                    fmt_pending;        /* 等待切换时新的帧不再持有采集缓冲区 */
+    struct wcamcli          *fmt_cli;           /* 最后请求切换的客户端, 失败时通知它 */
+
+    /* 以下预览状态只在采集线程中访问 */
+    pool_cq_t               view_cq;            /* 预览解码完成后回到采集线程 */
+    struct vid_frm          *view_frm;          /* frame to preview, 正在解码的帧 */
+    struct vid_frm          *view_next;         /* 解码完成后接着预览的最新帧 */
+
+    pthread_t               enc_tid;            /* YUYV编码线程 */
+    pthread_mutex_t         enc_mutex;
+    pthread_cond_t          enc_cond;
+    struct vid_frm          *enc_frm;           /* 等待编码的最新一帧 */
+    bool                    enc_quit;
 
     jpg_enc_t               enc;
     jpg_dec_t               dec;
@@ -42,47 +97,324 @@ struct vid {
     struct wcamsrv          *srv;
 };
 
+static struct vid_frm *vid_frm_alloc(int len)
+{
+    struct vid_frm *f = bufp_alloc(sizeof(struct vid_frm) + len);
+    if (!f) 
+		return NULL;
+    f->ref  = 1;
+    f->len  = len;
+    f->data = f->buf;
+    f->cam  = NULL;
+    return f;
+}
+
+/*
+ * 直接引用采集缓冲区p, 不复制
+ */
+static struct vid_frm *vid_frm_hold(v4l2_dev_t cam, const void *p, int len)
+{
+    struct vid_frm *f = bufp_alloc(sizeof(struct vid_frm));
+    if (!f) 
+		return NULL;
+    f->ref  = 1;
+    f->len  = len;
+    f->data = (__u8*)p;
+    f->cam  = cam;
+    return f;
+}
+
+static inline struct vid_frm *vid_frm_get(struct vid_frm *f)
+{
+    __sync_add_and_fetch(&f->ref, 1);
+    return f;
+}
+
+static inline void vid_frm_put(struct vid_frm *f)
+{
+    if (__sync_sub_and_fetch(&f->ref, 1))
+        return;
+    if (f->cam)
+        v4l2_put_buf(f->cam, f->data);
+    bufp_put(f);
+}
+
+static void vid_frm_release(void *arg)
+{
+    vid_frm_put(arg);
+}
+
+static inline __u64 vid_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * 应答帧结构: 字节 / 字段名称
+ * 1    | 2    | 4                  | 长度由4字节数据部分指定
+ * 长度 | 命令 | 数据(图像帧大小)   | 图像帧
+ * 使用扩展帧时图像帧直接作为数据, 帧大小在扩展帧头中
+ * 帧数据不复制, 发送完后释放f的引用
+ */
+static void vid_send_frm(tcpc_t c, __u8 type, __u8 id, struct vid_frm *f)
+{
+    __u8  hdr[FRAME_HDR_MAX];
+    __u32 size = f ? f->len : 0;
+
+    /* 推送与应答可能在不同线程中同时发送, 帧头和帧数据要连续入队 */
+    if (f)
+        tcpc_send_hdr_ref(c, hdr, build_large_hdr(c, hdr, type, id, size), 
+                          f->data, f->len, vid_frm_release, f);
+    else
+        tcpc_send(c, hdr, build_large_hdr(c, hdr, type, id, size));
+}
+
+/*
+ * 记录发给客户端的帧并统计跳过的帧数, 调用者持有sub_mutex. 
+ * 推送在采集线程中, VID_REQ_FRAME在客户端所在app的线程中, 两者都会调用
+ */
+static void vid_cli_sent_frm(struct wcamcli *wc, struct vid_frm *f)
+{
+    if (f->index > wc->last_frm_index + 1 && wc->last_frm_index)
+        wc->frm_skipped += f->index - wc->last_frm_index - 1;
+    wc->last_frm_index = f->index;
+}
+
+/*
+ * 推送一帧给客户端, 调用者持有sub_mutex, f的引用转给发送队列
+ */
+static void vid_push_frm2cli(struct wcamcli *wc, struct vid_frm *f)
+{
+    vid_cli_sent_frm(wc, f);
+    vid_send_frm(wc->cli, (TYPE_AREQ << TYPE_BIT_POS) | SUBS_VID, 
+                 REQUEST_ID(VID_PUSH_FRAME), f);
+}
+
+/*
+ * 向订阅的客户端推送新的一帧
+ *
+ * 慢速客户端的发送队列还有数据未发完时(VID_SUB_LATEST)或积压超过
+ * VID_SUB_QUEUE_MAX时, 新帧只替换该客户端的待发帧, 中间的帧被丢弃, 
+ * 待发送队列发送完(vid_cli_drain)时再发送, 
+ * 这样每个客户端最多占用一帧, 也不会影响其他客户端
+ */
+static void vid_push_frm(struct vid *v, struct vid_frm *f)
+{
+    struct wcamcli *wc;
+    int tx_len, tx_max;
+    __u64 now;
+
+    pthread_mutex_lock(&v->sub_mutex);
+    if (list_empty(&v->subs))
+        goto out;
+
+    now = vid_now_ms();
+    list_for_each_entry(wc, &v->subs, sub_entry) {
+        if (wc->sub_interval_ms && now - wc->last_push_ms < wc->sub_interval_ms)
+            continue;
+        wc->last_push_ms = now;
+
+        tx_len = tcpc_get_tx_len(wc->cli);
+        tx_max = (wc->sub_flags & VID_SUB_LATEST) ? 0 : VID_SUB_QUEUE_MAX;
+        if (tx_len > tx_max) {
+            if (wc->pending_frm)
+                vid_frm_put(wc->pending_frm);
+            wc->pending_frm = vid_frm_get(f);
+            continue;
+        }
+
+        if (wc->pending_frm) {
+            vid_frm_put(wc->pending_frm);
+            wc->pending_frm = NULL;
+        }
+        vid_push_frm2cli(wc, vid_frm_get(f));
+    }
+out:
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+/*
+ * 客户端发送队列发送完时调用, 发送推送时被暂存的最新帧
+ */
+void vid_cli_drain(vid_t vid, tcpc_t c)
+{
+    struct vid *v = vid;
+    struct wcamcli *wc = c->arg;
+
+    if (!wc->pending_frm)
+        return;
+
+    pthread_mutex_lock(&v->sub_mutex);
+    if (wc->pending_frm) {
+        vid_push_frm2cli(wc, wc->pending_frm);
+        wc->pending_frm = NULL;
+    }
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+/*
+ * 发布新的一帧, 替换当前帧并推送给订阅的客户端, 
+ * 发布者的引用转给v->tran_frm
+ */
+static void vid_publish_frm(struct vid *v, struct vid_frm *f)
+{
+    struct vid_frm *old;
+
+    pthread_mutex_lock(&v->tran_frm_mutex);
+    old = v->tran_frm;
+    f->index = ++v->tran_frm_index;
+    v->tran_frm = vid_frm_get(f);
+    pthread_mutex_unlock(&v->tran_frm_mutex);
+
+    if (old)
+        vid_frm_put(old);
+
+    vid_push_frm(v, f);
+    vid_frm_put(f);
+}
+
+static void vid_subscribe(struct vid *v, struct wcamcli *wc, 
+                          __u8 max_fps, __u8 flags)
+{
+    pthread_mutex_lock(&v->sub_mutex);
+    wc->sub_interval_ms = max_fps ? 1000 / max_fps : 0;
+    wc->sub_flags       = flags;
+    wc->last_push_ms    = 0;
+    if (list_empty(&wc->sub_entry))
+        list_add_tail(&wc->sub_entry, &v->subs);
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+static void vid_unsubscribe(struct vid *v, struct wcamcli *wc)
+{
+    pthread_mutex_lock(&v->sub_mutex);
+    list_del_init(&wc->sub_entry);
+    if (wc->pending_frm) {
+        vid_frm_put(wc->pending_frm);
+        wc->pending_frm = NULL;
+    }
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+/*
+ * 客户端释放前调用, 之后不会再向其推送
+ */
+void vid_cli_uninit(vid_t vid, tcpc_t c)
+{
+    struct wcamcli *wc = c->arg;
+    vid_unsubscribe(vid, wc);
+
+    pthread_mutex_lock(&vid->fmt_mutex);
+    if (vid->fmt_cli == wc)
+        vid->fmt_cli = NULL;
+    pthread_mutex_unlock(&vid->fmt_mutex);
+    pr_debug("client(sock: %d) skipped %u frames\n", c->sock, wc->frm_skipped);
+}
+
+/*
+ * 取得当前帧的引用, 当前帧的编号与last_index相同时返回NULL
+ */
+static struct vid_frm *vid_get_tran_frm(struct vid *v, __u64 last_index)
+{
+    struct vid_frm *f = NULL;
+
+    pthread_mutex_lock(&v->tran_frm_mutex);
+    if (v->tran_frm && v->tran_frm->index != last_index)
+        f = vid_frm_get(v->tran_frm);
+    pthread_mutex_unlock(&v->tran_frm_mutex);
+    return f;
+}
+
 static void *decJpg2preview(void *arg)
 {
     struct vid *v = arg;
+    struct vid_frm *f = v->view_frm;
     int width, height;
     const void* p;
     int l;
 
-    //pr_debug("jpg framesize = %d\n", v->view_frm.len);
-    jpg_dec_frame(v->dec, v->view_frm.start, v->view_frm.len);
+    //pr_debug("jpg framesize = %d\n", f->len);
+    jpg_dec_frame(v->dec, f->data, f->len);
     p = jpg_dec_get_outbuf(v->dec, &l);
     jpg_dec_get_frmsiz(v->dec, &width, &height);
     //pr_debug("yuv framesize = %d(%d x %d)\n", l, width, height);
 
     fbd_show_yuv_frame(v->fbd, p, width, height);
-    free(v->view_frm.start);
-    v->view_frm.start = NULL;
     return NULL;
 }
 
-static void handle_jpeg_img_proc(const void *p, int size, void *arg)
+static void vid_preview_done(pool_task_t t, void *arg);
+
+/*
+ * 在线程池中预览f, 同时只有一帧在解码, 
+ * 解码完成后通过view_cq回到采集线程, 不需要加锁
+ */
+static void vid_preview(struct vid *v, struct vid_frm *f)
+{
+    v->view_frm = f;
+    if (pool_submit_cq(v->srv->pool, v->view_cq, 
+                       decJpg2preview, v, vid_preview_done, v)) {
+        v->view_frm = NULL;
+        vid_frm_put(f);
+    }
+}
+
+static void vid_preview_done(pool_task_t t, void *arg)
 {
     struct vid *v = arg;
+    struct vid_frm *f = v->view_next;
 
-    pthread_mutex_lock(&v->tran_frm_mutex);
-    v->tran_frm.start = (void*)p;
-    v->tran_frm.len   = size;
-    v->tran_frm_index++;
-    pthread_mutex_unlock(&v->tran_frm_mutex);
+    vid_frm_put(v->view_frm);
+    v->view_frm  = NULL;
+    v->view_next = NULL;
+    if (f)
+        vid_preview(v, f);
+}
 
-    if (v->view_frm.start == NULL) {
-        v->view_frm.len = size;
-        v->view_frm.start = malloc(size);
-        memcpy(v->view_frm.start, p, size);
-        pool_add_worker(v->srv->pool, decJpg2preview, v);
+/*
+ * 驱动队列中还有足够的缓冲区时, 帧数据留在采集缓冲区中发布, 
+ * 由最后一个引用者送回驱动; 否则复制一次, 采集缓冲区马上送回
+ */
+static int handle_jpeg_img_proc(const void *p, int size, void *arg)
+{
+    struct vid *v = arg;
+    struct vid_frm *f = NULL;
+    __u32 held, nr;
+    int ret = V4L2_BUF_DONE;
+
+    /* 当前这个缓冲区已计入held */
+    nr = v4l2_get_buf_nr(v->cam, &held);
+    if (held + VID_CAM_RESERVE <= nr && !v->fmt_pending) {
+        f = vid_frm_hold(v->cam, p, size);
+        if (f)
+            ret = V4L2_BUF_HOLD;
     }
+    if (f == NULL) {
+        f = vid_frm_alloc(size);
+        if (f == NULL) 
+            return V4L2_BUF_DONE;
+        memcpy(f->data, p, size);
+    }
+
+    /* 预览只需要最新的一帧, 解码跟不上时等待的旧帧直接被替换 */
+    if (v->view_frm == NULL) {
+        vid_preview(v, vid_frm_get(f));
+    } else {
+        if (v->view_next)
+            vid_frm_put(v->view_next);
+        v->view_next = vid_frm_get(f);
+    }
+
+    vid_publish_frm(v, f);
+    return ret;
 }
 
-static void *encJpg4transfer(void *arg)
+static void encJpg4transfer(struct vid *v, const void *yuv)
 {
-    struct vid *v = arg;
     struct v4l2_frmsizeenum frm;
+    struct vid_frm *f;
     void *pbuf;
     int width, height;
     int  l;
@@ -92,92 +424,488 @@ static void *encJpg4transfer(void *arg)
     width  = frm.discrete.width; 
     height = frm.discrete.height; 
 
-    fbd_show_yuv_frame(v->fbd, v->view_frm.start, width, height);
-    //pr_debug("yuv framesize = %d(%d x %d)\n", v->view_frm.len, width, height);
-    jpg_enc_yuyv_frame(v->enc, v->view_frm.start, width, height);
+    fbd_show_yuv_frame(v->fbd, yuv, width, height);
+    jpg_enc_yuyv_frame(v->enc, yuv, width, height);
     pbuf = jpg_enc_get_outbuf(v->enc, &l);
 
-    pthread_mutex_lock(&v->tran_frm_mutex);
-    if (v->tran_frm_max_size < l) { 
-        v->tran_frm.start = realloc(v->tran_frm.start, l);
-        v->tran_frm_max_size = l;
+    f = vid_frm_alloc(l);
+    if (f) {
+        memcpy(f->data, pbuf, l);
+        vid_publish_frm(v, f);
     }
-    memcpy(v->tran_frm.start, pbuf, l);
-    v->tran_frm.len = l;
-    v->tran_frm_index++;
-    pthread_mutex_unlock(&v->tran_frm_mutex);
     
-    //pr_debug("jpg framesize = %d\n", v->tran_frm.len);
+    //pr_debug("jpg framesize = %d\n", l);
+}
+
+/*
+ * YUYV编码线程, 编码和预览不在事件循环线程中执行, 
+ * 每次只编码最新的一帧, 编码完后把采集缓冲区送回驱动
+ */
+static void *vid_enc_thread(void *arg)
+{
+    struct vid *v = arg;
+    struct vid_frm *f;
+
+    thread_set_sched(cfg_get_thread_sched(v->srv->cfg, THREAD_ENCODER));
+    for (;;) {
+        pthread_mutex_lock(&v->enc_mutex);
+        while (v->enc_frm == NULL && !v->enc_quit)
+            pthread_cond_wait(&v->enc_cond, &v->enc_mutex);
+        if (v->enc_quit) {
+            pthread_mutex_unlock(&v->enc_mutex);
+            break;
+        }
+        f = v->enc_frm;
+        v->enc_frm = NULL;
+        pthread_mutex_unlock(&v->enc_mutex);
+
+        encJpg4transfer(v, f->data);
+        vid_frm_put(f);
+    }
     return NULL;
 }
 
-static void handle_yuyv_img_proc(const void *p, int size, void *arg)
+/*
+ * 采集缓冲区交给编码线程, 编码线程还没取走的上一帧直接送回驱动,
+ * 所以最多持有两个采集缓冲区(正在编码的和等待编码的). 
+ * 等待切换格式时复制一次, 采集缓冲区马上送回
+ */
+static int handle_yuyv_img_proc(const void *p, int size, void *arg)
 {
     struct vid *v = arg;
+    struct vid_frm *f = NULL, *old;
+    int ret = V4L2_BUF_DONE;
+
+    if (!v->fmt_pending) {
+        f = vid_frm_hold(v->cam, p, size);
+        if (f)
+            ret = V4L2_BUF_HOLD;
+    }
+    if (f == NULL) {
+        f = vid_frm_alloc(size);
+        if (f == NULL) 
+            return V4L2_BUF_DONE;
+        memcpy(f->data, p, size);
+    }
+
+    pthread_mutex_lock(&v->enc_mutex);
+    old = v->enc_frm;
+    v->enc_frm = f;
+    pthread_cond_signal(&v->enc_cond);
+    pthread_mutex_unlock(&v->enc_mutex);
 
-    v->view_frm.len   = size;
-    v->view_frm.start = p;
-    encJpg4transfer(v);
+    if (old)
+        vid_frm_put(old);
+    return ret;
 }
 
-vid_t vid_create(struct wcamsrv *ws) 
+static int vid_enc_start(struct vid *v)
 {
-    struct v4l2_fmtdesc     fmt;
-    struct vid *v = calloc(1, sizeof(struct vid));
-    if (!v) {
-		perror("vid_create");
-		return NULL;
+    v->enc_quit = false;
+	if (pthread_mutex_init(&v->enc_mutex, NULL)) {
+		perror("vid_enc_start: pthread_mutex_init");
+		return -1;
 	}
 
-    v->srv = ws;
-    v->cam = v4l2_create(v->srv->app, cfg_get_camdev(v->srv->cfg), 
-                                      cfg_get_cam_fmt_nr(v->srv->cfg),
-                                      cfg_get_cam_frm_nr(v->srv->cfg));
-    if (v->cam == NULL)
-        goto err_mem;
-    
-	if (pthread_mutex_init(&v->tran_frm_mutex, NULL)) {
-		perror("vid_create: pthread_mutex_init");
-		goto err_v4l2;	
+	if (pthread_cond_init(&v->enc_cond, NULL)) {
+		perror("vid_enc_start: pthread_cond_init");
+		goto err_mutex;
 	}
 
-    v4l2_get_fmt(v->cam, 0, &fmt);
+    if (pthread_create(&v->enc_tid, NULL, vid_enc_thread, v)) {
+		perror("vid_enc_start: pthread_create");
+		goto err_cond;
+    }
+    return 0;
+
+err_cond:
+    pthread_cond_destroy(&v->enc_cond);
+err_mutex:
+    pthread_mutex_destroy(&v->enc_mutex);
+    return -1;
+}
+
+/*
+ * 切换中停止的编码线程重新启动, 失败时不再处理YUYV帧
+ */
+static void vid_enc_resume(struct vid *v)
+{
+    if (v->enc && vid_enc_start(v)) {
+        jpg_enc_free(v->enc);
+        v->enc = NULL;
+        v4l2_set_img_proc(v->cam, NULL, NULL);
+    }
+}
+
+static void vid_enc_stop(struct vid *v)
+{
+    pthread_mutex_lock(&v->enc_mutex);
+    v->enc_quit = true;
+    pthread_cond_signal(&v->enc_cond);
+    pthread_mutex_unlock(&v->enc_mutex);
+    pthread_join(v->enc_tid, NULL);
+
+    if (v->enc_frm) {
+        vid_frm_put(v->enc_frm);
+        v->enc_frm = NULL;
+    }
+    pthread_cond_destroy(&v->enc_cond);
+    pthread_mutex_destroy(&v->enc_mutex);
+}
+
+/*
+ * 按当前的采集格式创建编解码器和预览, 设置图像处理回调
+ */
+static int vid_proc_setup(struct vid *v)
+{
+    struct v4l2_fmtdesc     fmt;
+    v4l2_img_proc_t         proc;
+
+    v4l2_get_fmt(v->cam, v4l2_get_cur_fmt_nr(v->cam), &fmt);
 
     if (fmt.pixelformat == V4L2_PIX_FMT_JPEG) {
-        v4l2_set_img_proc(v->cam, handle_jpeg_img_proc, v);  
+        proc = handle_jpeg_img_proc;
         v->dec = jpg_dec_create();
         if (v->dec == NULL)
-            goto err_mutex;
+            return -1;
+        v->view_cq = pool_cq_create(v->srv->app);
+        if (v->view_cq == NULL)
+            goto err_codec;
     } else if (fmt.pixelformat == V4L2_PIX_FMT_YUYV) {
-        v4l2_set_img_proc(v->cam, handle_yuyv_img_proc, v);  
+        proc = handle_yuyv_img_proc;
         v->enc = jpg_enc_create();
         if (v->enc == NULL)
-            goto err_mutex;
+            return -1;
+        if (vid_enc_start(v)) 
+            goto err_codec;
     } else {
         pr_debug("Capture video format is %s, but now we just "
                  "support JPEG and YUYV.\n", 
                  fmt.description); 
-        goto err_mutex;
+        return -1;
     }
 
     v->fbd = fbd_create(0, cfg_get_fb_bpp(v->srv->cfg), 0, 0,
                            cfg_get_fb_width(v->srv->cfg),
                            cfg_get_fb_height(v->srv->cfg));
     if (v->fbd == NULL) 
-        goto err_codec;
+        goto err_enc;
 
-    if (v4l2_start_capture(v->cam))
-        goto err_fbd;
+    v4l2_set_img_proc(v->cam, proc, v);  
+    return 0;
 
-    return v;
-err_fbd:
-    fbd_free(v->fbd);
+err_enc:
+    if (v->enc)
+        vid_enc_stop(v);
 err_codec: 
+    if (v->view_cq)
+        pool_cq_free(v->view_cq);
+    if (v->enc)
+        jpg_enc_free(v->enc);
+    if (v->dec)
+        jpg_dec_free(v->dec);
+    v->view_cq = NULL;
+    v->enc = NULL;
+    v->dec = NULL;
+    return -1;
+}
+
+/*
+ * 释放编解码器和预览, 编码线程已经停止
+ */
+static void vid_proc_free(struct vid *v)
+{
+    v4l2_set_img_proc(v->cam, NULL, NULL);
+    if (v->view_cq)
+        pool_cq_free(v->view_cq);
+    if (v->view_next)
+        vid_frm_put(v->view_next);
+    if (v->fbd)
+        fbd_free(v->fbd);
     if (v->enc)
         jpg_enc_free(v->enc);
     if (v->dec)
         jpg_dec_free(v->dec);
+    v->view_cq   = NULL;
+    v->view_next = NULL;
+    v->fbd       = NULL;
+    v->enc       = NULL;
+    v->dec       = NULL;
+}
+
+/*
+ * 释放当前帧和各客户端待发的帧, 切换格式后不再发送旧格式的帧,
+ * 它们持有的采集缓冲区也尽快送回驱动
+ */
+static void vid_drop_frms(struct vid *v)
+{
+    struct vid_frm *old;
+    struct wcamcli *wc;
+
+    pthread_mutex_lock(&v->tran_frm_mutex);
+    old = v->tran_frm;
+    v->tran_frm = NULL;
+    pthread_mutex_unlock(&v->tran_frm_mutex);
+    if (old)
+        vid_frm_put(old);
+
+    if (v->view_next) {
+        vid_frm_put(v->view_next);
+        v->view_next = NULL;
+    }
+
+    pthread_mutex_lock(&v->sub_mutex);
+    list_for_each_entry(wc, &v->subs, sub_entry) {
+        if (wc->pending_frm) {
+            vid_frm_put(wc->pending_frm);
+            wc->pending_frm = NULL;
+        }
+    }
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+static void vid_get_cur_fmt(struct vid *v, struct vid_fmt_changed *fc)
+{
+    struct v4l2_frmsizeenum frm;
+
+    fc->fmt_nr = v4l2_get_cur_fmt_nr(v->cam);
+    fc->frm_nr = v4l2_get_cur_frm_nr(v->cam);
+    v4l2_get_frmsize(v->cam, fc->fmt_nr, fc->frm_nr, &frm);
+    fc->width  = frm.discrete.width;
+    fc->height = frm.discrete.height;
+    v4l2_get_fps(v->cam, &fc->ival);
+    fc->err    = 0;
+}
+
+/*
+ * 通知订阅推送的客户端新的格式, 帧大小和帧间隔
+ */
+static void vid_notify_fmt(struct vid *v)
+{
+    struct vid_fmt_changed fc;
+    struct wcamcli *wc;
+
+    vid_get_cur_fmt(v, &fc);
+    pthread_mutex_lock(&v->sub_mutex);
+    list_for_each_entry(wc, &v->subs, sub_entry) {
+        build_and_send_rsp(wc->cli, (TYPE_AREQ << TYPE_BIT_POS) | SUBS_VID, 
+                           REQUEST_ID(VID_FMT_CHANGED), sizeof(fc), (__u8*)&fc);
+    }
+    pthread_mutex_unlock(&v->sub_mutex);
+}
+
+/*
+ * 切换失败时通知请求的客户端, 其中是仍在使用的格式和失败的errno. 
+ * 调用者持有fmt_mutex, 客户端不会同时被释放
+ */
+static void vid_notify_fmt_err(struct vid *v, struct wcamcli *wc, int err)
+{
+    struct vid_fmt_changed fc;
+
+    vid_get_cur_fmt(v, &fc);
+    fc.err = err;
+    build_and_send_rsp(wc->cli, (TYPE_AREQ << TYPE_BIT_POS) | SUBS_VID, 
+                       REQUEST_ID(VID_FMT_CHANGED), sizeof(fc), (__u8*)&fc);
+}
+
+/*
+ * 在采集线程中切换格式, 先送回编码线程和各帧持有的采集缓冲区, 
+ * 切换后按新的格式重新创建编解码器和预览. 
+ * 预览正在解码或采集缓冲区还没送回时返回-1, errno为EBUSY
+ */
+static int vid_switch_fmt(struct vid *v, __u32 fmt_nr, __u32 frm_nr)
+{
+    int ret, err;
+
+    if (fmt_nr == v4l2_get_cur_fmt_nr(v->cam) && 
+        frm_nr == v4l2_get_cur_frm_nr(v->cam))
+        return 0;
+
+    /* 解码完成前不能释放解码器 */
+    if (v->view_frm) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    vid_drop_frms(v);
+    if (v->enc)
+        vid_enc_stop(v);
+
+    ret = v4l2_switch_fmt(v->cam, fmt_nr, frm_nr);
+    err = errno;
+    if (ret == -1) {
+        /* 格式没有改变, 只需重新启动编码线程 */
+        vid_enc_resume(v);
+        errno = err;
+        return -1;
+    }
+
+    vid_proc_free(v);
+    if (vid_proc_setup(v)) 
+        pr_debug("no image processing for format %u\n", fmt_nr);
+
+    vid_notify_fmt(v);
+    return 0;
+}
+
+/*
+ * 在采集线程中设置帧率, 驱动可能要重新开始采集, 所以与切换格式一样
+ * 先送回编码线程和各帧持有的采集缓冲区
+ */
+static int vid_switch_fps(struct vid *v, __u32 fps)
+{
+    int ret, err;
+
+    if (fps == v4l2_get_fps(v->cam, NULL))
+        return 0;
+
+    vid_drop_frms(v);
+    if (v->enc)
+        vid_enc_stop(v);
+
+    ret = v4l2_set_fps(v->cam, fps);
+    err = errno;
+    vid_enc_resume(v);
+    if (ret == 0)
+        vid_notify_fmt(v);
+    errno = err;
+    return ret;
+}
+
+/*
+ * 在采集线程中执行切换请求. fmt_pending期间新的帧都复制到bufpool, 
+ * 驱动不能释放仍被映射的缓冲区时, 等各客户端发送队列中的帧
+ * 送回全部采集缓冲区后再切换, 连续VID_FMT_RETRY_MAX次没有缓冲区
+ * 送回时放弃, 用带错误码的VID_FMT_CHANGED通知请求的客户端
+ */
+static void vid_fmt_timer(struct app_timer *t)
+{
+    struct vid *v = container_of(t, struct vid, fmt_timer);
+    __u32 fmt_nr, frm_nr, fps, busy;
+    bool wait;
+    int ret, err;
+
+    pthread_mutex_lock(&v->fmt_mutex);
+    fmt_nr = v->fmt_nr;
+    frm_nr = v->frm_nr;
+    fps    = v->fps;
+    wait   = v->fmt_wait;
+    pthread_mutex_unlock(&v->fmt_mutex);
+
+    /* 缓冲区还没全部送回时尝试也会失败, 不用反复停止编码线程 */
+    busy = v4l2_get_busy_buf_nr(v->cam);
+    if (wait && busy) {
+        ret = -1;
+        err = EBUSY;
+    } else {
+        ret = vid_switch_fmt(v, fmt_nr, frm_nr);
+        if (ret == 0)
+            ret = vid_switch_fps(v, fps);
+        err = errno;
+    }
+
+    pthread_mutex_lock(&v->fmt_mutex);
+    /* 期间有新的请求, 它已经重新设置了定时器 */
+    if (fmt_nr != v->fmt_nr || frm_nr != v->frm_nr || fps != v->fps)
+        goto out;
+
+    if (ret == -1 && err == EBUSY) {
+        /* 有缓冲区送回时重新计数 */
+        if (busy < v->fmt_busy)
+            v->fmt_retry = 0;
+        v->fmt_busy = busy;
+        v->fmt_wait = true;
+        if (v->fmt_retry++ < VID_FMT_RETRY_MAX) {
+            app_timer_mod(v->srv->app, t, APP_TIMER_TICK_MS);
+            goto out;
+        }
+    }
+
+    if (ret == -1) {
+        pr_debug("failed to switch to format %u, frame size %u, %u fps: %s\n", 
+                 fmt_nr, frm_nr, fps, strerror(err));
+        if (v->fmt_cli)
+            vid_notify_fmt_err(v, v->fmt_cli, err);
+    }
+    v->fmt_pending = false;
+    v->fmt_cli     = NULL;
+out:
+    pthread_mutex_unlock(&v->fmt_mutex);
+}
+
+/*
+ * 记录切换请求后在采集线程中执行, 调用者持有fmt_mutex
+ */
+static void vid_fmt_request(struct vid *v, struct wcamcli *wc)
+{
+    v->fmt_retry   = 0;
+    v->fmt_busy    = 0;
+    v->fmt_wait    = false;
+    v->fmt_pending = true;
+    v->fmt_cli     = wc;
+    app_timer_mod(v->srv->app, &v->fmt_timer, 0);
+}
+
+vid_t vid_create(struct wcamsrv *ws) 
+{
+    struct vid *v = calloc(1, sizeof(struct vid));
+    if (!v) {
+		perror("vid_create");
+		return NULL;
+	}
+
+    v->srv = ws;
+    v->cam = v4l2_create(v->srv->app, cfg_get_camdev(v->srv->cfg), 
+                                      cfg_get_cam_fmt_nr(v->srv->cfg),
+                                      cfg_get_cam_frm_nr(v->srv->cfg));
+    if (v->cam == NULL)
+        goto err_mem;
+    
+    if (pthread_mutex_init(&v->tran_frm_mutex, NULL)) {
+        perror("vid_create: pthread_mutex_init");
+        goto err_v4l2;
+    }
+
+    if (pthread_mutex_init(&v->sub_mutex, NULL)) {
+        perror("vid_create: pthread_mutex_init");
+        goto err_tran;
+    }
+
+    if (pthread_mutex_init(&v->uctls_mutex, NULL)) {
+        perror("vid_create: pthread_mutex_init");
+        goto err_sub;
+    }
+
+    if (pthread_mutex_init(&v->fmt_mutex, NULL)) {
+        perror("vid_create: pthread_mutex_init");
+        goto err_uctls;
+    }
+    INIT_LIST_HEAD(&v->subs);
+    app_timer_init(&v->fmt_timer, vid_fmt_timer);
+    v->fmt_nr = v4l2_get_cur_fmt_nr(v->cam);
+    v->frm_nr = v4l2_get_cur_frm_nr(v->cam);
+    v->fps    = cfg_get_cam_fps(v->srv->cfg);
+    if (v->fps && v4l2_set_fps(v->cam, v->fps))
+        pr_debug("failed to set frame rate to %u fps\n", v->fps);
+
+    if (vid_proc_setup(v))
+        goto err_mutex;
+
+    if (v4l2_start_capture(v->cam))
+        goto err_proc;
+
+    return v;
+err_proc:
+    if (v->enc)
+        vid_enc_stop(v);
+    vid_proc_free(v);
 err_mutex:
+    pthread_mutex_destroy(&v->fmt_mutex);
+err_uctls:
+    pthread_mutex_destroy(&v->uctls_mutex);
+err_sub:
+    pthread_mutex_destroy(&v->sub_mutex);
+err_tran:
     pthread_mutex_destroy(&v->tran_frm_mutex);
 err_v4l2:
     v4l2_free(v->cam);
@@ -189,31 +917,96 @@ err_mem:
 void vid_free(vid_t vid)
 {
     struct vid *v = vid;
-    v4l2_stop_capture(v->cam);
-    fbd_free(v->fbd);
+    app_timer_del(v->srv->app, &v->fmt_timer);
     if (v->enc)
-        jpg_enc_free(v->enc);
-    if (v->dec)
-        jpg_dec_free(v->dec);
+        vid_enc_stop(v);
+    if (v->tran_frm)
+        vid_frm_put(v->tran_frm);
+    v4l2_stop_capture(v->cam);
+    vid_proc_free(v);
     v4l2_free(v->cam);
+    if (v->uctls_blob.data)
+        bufp_put(v->uctls_blob.data);
+    if (v->uctl_list_blob.data)
+        bufp_put(v->uctl_list_blob.data);
+    pthread_mutex_destroy(&v->fmt_mutex);
+    pthread_mutex_destroy(&v->uctls_mutex);
+    pthread_mutex_destroy(&v->sub_mutex);
+    pthread_mutex_destroy(&v->tran_frm_mutex);
     free(v);
 }
 
+/*
+ * 请求在接收缓冲区中的位置任意, 不能直接按__u32读写, 与vid_set_uctl一样复制
+ */
 static void vid_get_uctl(struct vid *v, __u8 *req, __u8 *rsp) 
 {
-    __s32 *val = (__s32*)rsp;
-    __u32 *id  = (__u32*)req;
+    __u32 id;
+    __s32 val;
     bool ok;
-    *val = v4l2_get_uctl(v->cam, *id, &ok);
+    memcpy(&id, req, 4);
+    val = v4l2_get_uctl(v->cam, id, &ok);
+    memcpy(rsp, &val, 4);
 }
 
-static __u32 vid_get_uctls(struct vid *v, __u8 *rsp)
+static __u8 *vid_build_uctls(struct vid *v, __u32 ver, __u32 *size)
 {
-    struct v4l2_uctl *uctls = (struct v4l2_uctl *)rsp;
-	__u32 uctls_nr;
-    uctls_nr = v4l2_get_uctls_nr(v->cam);
-    v4l2_get_uctls(v->cam, uctls);
-    return uctls_nr * sizeof(struct v4l2_uctl);
+    __u8 *blob;
+
+    *size = v4l2_get_uctls_nr(v->cam) * sizeof(struct v4l2_uctl);
+    blob  = bufp_alloc(*size);
+    if (blob)
+        v4l2_get_uctls(v->cam, (struct v4l2_uctl *)blob);
+    return blob;
+}
+
+static __u8 *vid_build_uctl_list(struct vid *v, __u32 ver, __u32 *size)
+{
+    struct vid_uctl_list_hdr *hdr;
+    __u32 nr;
+
+    *size = sizeof(*hdr) + v4l2_get_uctl_infos_size(v->cam, &nr);
+    hdr   = bufp_alloc(*size);
+    if (!hdr)
+        return NULL;
+    hdr->fmt      = VID_UCTL_LIST_FMT;
+    hdr->ver      = ver;
+    hdr->nr       = nr;
+    hdr->reserved = 0;
+    v4l2_get_uctl_infos(v->cam, hdr + 1);
+    return (__u8 *)hdr;
+}
+
+/*
+ * 取得序列化好的控制项列表的引用, 控制项的版本改变时用build重新生成,
+ * 调用者发送完后bufp_put
+ */
+static __u8 *vid_get_blob(struct vid *v, struct vid_blob *b, 
+                          __u8 *(*build)(struct vid *, __u32, __u32 *), 
+                          __u32 *size)
+{
+    __u8 *blob;
+    __u32 ver;
+
+    pthread_mutex_lock(&v->uctls_mutex);
+    /* 先取版本再读列表, 读列表期间改变的话下次会再生成 */
+    ver = v4l2_get_uctls_ver(v->cam);
+    if (!b->data || !ver || ver != b->ver) {
+        blob = build(v, ver, size);
+        if (!blob) {
+            pthread_mutex_unlock(&v->uctls_mutex);
+            return NULL;
+        }
+        if (b->data)
+            bufp_put(b->data);
+        b->data = blob;
+        b->size = *size;
+        b->ver  = ver;
+    }
+    blob  = bufp_get(b->data);
+    *size = b->size;
+    pthread_mutex_unlock(&v->uctls_mutex);
+    return blob;
 }
 
 static void vid_set_uctl(struct vid *v, __u8 *req)
@@ -225,10 +1018,95 @@ static void vid_set_uctl(struct vid *v, __u8 *req)
     v4l2_set_uctl(v->cam, id, val);   
 }
 
-#if 0
+/*
+ * 发送完整的控制项列表, 客户端已有的版本known与当前版本相同时只发送列表头
+ */
+static void vid_send_uctl_list(struct vid *v, tcpc_t c, __u8 id, __u32 known)
+{
+    struct vid_uctl_list_hdr *lh;
+    __u8 hdr[FRAME_HDR_MAX];
+    __u8 *blob, *rsp;
+    __u32 size;
+
+    blob = vid_get_blob(v, &v->uctl_list_blob, vid_build_uctl_list, &size);
+    if (!blob)
+        return;
+
+    lh = (struct vid_uctl_list_hdr *)blob;
+    if (lh->ver && lh->ver == known) {
+        rsp = bufp_alloc(FRAME_HDR_MAX + sizeof(*lh));
+        if (rsp) {
+            memcpy(&rsp[FRAME_HDR_MAX], lh, sizeof(*lh));
+            ((struct vid_uctl_list_hdr *)&rsp[FRAME_HDR_MAX])->nr = 0;
+            build_and_send_large_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID,
+                                     id, rsp, sizeof(*lh));
+        }
+        bufp_put(blob);
+        return;
+    }
+
+    tcpc_send_hdr_ref(c, hdr, build_large_hdr(c, hdr, 
+                      (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, id, size),
+                      blob, size, bufp_put, blob);
+}
+
+/*
+ * req中是nr个id, 值写到rsp中, 请求数据不一定对齐, 所以复制出来
+ */
+static void vid_get_uctl_multi(struct vid *v, __u8 *req, __u32 nr, __u8 *rsp)
+{
+    struct v4l2_uctl_val *vals = (struct v4l2_uctl_val *)rsp;
+    __u32 i;
+
+    for (i = 0; i < nr; i++)
+        memcpy(&vals[i].id, &req[i * sizeof(__u32)], sizeof(__u32));
+    v4l2_get_uctl_multi(v->cam, vals, nr);
+}
+
+/*
+ * 设置结果写到ack中, 驱动拒绝时不逐个重试, 由客户端根据err_idx处理
+ */
+static int vid_set_uctls(struct vid *v, __u8 *req, __u32 nr, 
+                         struct vid_uctls_ack *ack)
+{
+    struct v4l2_uctl_val *vals;
+    int ret;
+
+    ack->err     = 0;
+    ack->err_idx = nr;
+    vals = bufp_alloc(nr * sizeof(struct v4l2_uctl_val));
+    if (!vals) {
+        ack->err = ENOMEM;
+        return -1;
+    }
+    memcpy(vals, req, nr * sizeof(struct v4l2_uctl_val));
+    ret = v4l2_set_uctl_multi(v->cam, vals, nr, &ack->err_idx);
+    if (ret)
+        ack->err = errno;
+    bufp_put(vals);
+    return ret;
+}
+
+static __u32 vid_get_fmts_size(struct vid *v)
+{
+    __u32 i, j, fmts_nr, frms_nr, size = 0;
+
+    fmts_nr = v4l2_get_fmts_nr(v->cam);
+    for (i = 0; i < fmts_nr; i++) {
+        frms_nr = v4l2_get_fmt_frms_nr(v->cam, i);
+        size += sizeof(struct v4l2_fmtdesc) + sizeof(__u32);
+        for (j = 0; j < frms_nr; j++) {
+            size += sizeof(struct v4l2_frmsizeenum) + sizeof(__u32) + 
+                    v4l2_get_frm_ivals_nr(v->cam, i, j) * 
+                    sizeof(struct v4l2_frmivalenum);
+        }
+    }
+    return size;
+}
+
 static __u32 vid_get_fmts(struct vid *v, __u8 *rsp)
 {
-    __u32 i, j, fmts_nr, frms_nr;
+    __u32 i, j, k, fmts_nr, frms_nr, ivals_nr;
     __u8 *p = rsp;
 
     fmts_nr = v4l2_get_fmts_nr(v->cam);
@@ -241,18 +1119,63 @@ static __u32 vid_get_fmts(struct vid *v, __u8 *rsp)
         for (j = 0; j < frms_nr; j++) {
             v4l2_get_frmsize(v->cam, i, j, (struct v4l2_frmsizeenum*)p);
             p += sizeof(struct v4l2_frmsizeenum);
+            ivals_nr = v4l2_get_frm_ivals_nr(v->cam, i, j);
+            memcpy(p, &ivals_nr, sizeof(__u32));
+            p += sizeof(__u32);
+            for (k = 0; k < ivals_nr; k++) {
+                v4l2_get_frm_ival(v->cam, i, j, k, (struct v4l2_frmivalenum*)p);
+                p += sizeof(struct v4l2_frmivalenum);
+            }
         }
     }
     return (p - rsp);
 }
 
-static void vid_set_fmt(struct vid *v, __u8 *req)
+/*
+ * 切换格式要停止采集, 交给采集线程执行, 连续的请求只执行最后一个
+ */
+static int vid_set_fmt(struct vid *v, struct wcamcli *wc, __u8 *req)
 {
-    __u32 *fmt_nr  = (__u32*)(&req[0]);
-    __u32 *frm_nr  = (__u32*)(&req[4]);
-    v4l2_set_fmt(v->cam, *fmt_nr, *frm_nr);   
+    struct v4l2_fmtdesc     fmt;
+    struct v4l2_frmsizeenum frm;
+    __u32 fmt_nr, frm_nr;
+
+    memcpy(&fmt_nr, &req[0], sizeof(__u32));
+    memcpy(&frm_nr, &req[4], sizeof(__u32));
+    if (v4l2_get_frmsize(v->cam, fmt_nr, frm_nr, &frm) ||
+        v4l2_get_fmt(v->cam, fmt_nr, &fmt))
+        return -1;
+    if (fmt.pixelformat != V4L2_PIX_FMT_JPEG && 
+        fmt.pixelformat != V4L2_PIX_FMT_YUYV)
+        return -1;
+
+    pthread_mutex_lock(&v->fmt_mutex);
+    v->fmt_nr = fmt_nr;
+    v->frm_nr = frm_nr;
+    vid_fmt_request(v, wc);
+    pthread_mutex_unlock(&v->fmt_mutex);
+    return 0;
+}
+
+/*
+ * 设置目标帧率, 与切换格式一样在采集线程中执行, 
+ * 没有客户端观看时可以降低帧率减少采集和编码的开销
+ */
+static void vid_set_fps(struct vid *v, struct wcamcli *wc, __u8 *req)
+{
+    pthread_mutex_lock(&v->fmt_mutex);
+    memcpy(&v->fps, req, sizeof(__u32));
+    vid_fmt_request(v, wc);
+    pthread_mutex_unlock(&v->fmt_mutex);
+}
+
+static void vid_get_fps(struct vid *v, __u8 *rsp)
+{
+    struct vid_fps vf;
+
+    vf.fps = v4l2_get_fps(v->cam, &vf.ival);
+    memcpy(rsp, &vf, sizeof(vf));
 }
-#endif
 
 static void vid_get_fmt(struct vid *v, __u8 *rsp) 
 {
@@ -268,26 +1191,27 @@ static void vid_get_frmsiz(struct vid *v, __u8 *rsp)
     memcpy(rsp, &frm.discrete, sizeof(struct v4l2_frmsize_discrete));
 }
 
-static __u32 vid_get_trans_frame(struct vid *v, __u8 *rsp)
-{
-    memcpy(rsp, v->tran_frm.start, v->tran_frm.len); 
-    return v->tran_frm.len;
-}
-
 int vid_cmd_proc(tcpc_t c) 
 {
     struct wcamcli  *wc     = c->arg;
     struct vid      *v      = wc->srv->vid;
     __u8            *req    = wc->req;
-    __u8            *rsp    = wc->rsp;
+    __u8            *rsp;
     __u8            id      = req[CMD1_POS];
     __u8            status  = ERR_SUCCESS;
     __u8            dat[FRAME_DAT_MAX];
-    __u32           pos, len, size;
+    __u8            hdr[FRAME_HDR_MAX];
+    __u32           len, size;
+    struct vid_frm  *f;
+    struct vid_uctls_ack ack;
 
     switch (id) {
     case REQUEST_ID(VID_GET_UCTL):
-        vid_get_uctl(v, &req[DAT_POS], dat);
+        if (wc->req_len < REQUEST_LEN(VID_GET_UCTL)) {
+            status = ERR_PARAM;
+            break;
+        }
+        vid_get_uctl(v, wc->req_dat, dat);
         build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID,
                            id, 4, dat);
 		break;
@@ -296,15 +1220,61 @@ int vid_cmd_proc(tcpc_t c)
          * 应答帧结构: 字节 / 字段名称
          * 1    | 2    | 4                      | 长度由4字节数据部分指定
          * 长度 | 命令 | 数据(控制项列表大小)   | 控制项列表
+         * 使用扩展帧时控制项列表直接作为数据
+         * 控制项列表是各客户端共享的, 只复制帧头
          */
-        len = sizeof(__u32);
-        pos = FRAME_HDR_SZ + len;
-        size = vid_get_uctls(v, &rsp[pos]);
-        build_rsp(rsp, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, id, len, (__u8*)&size);
-        tcpc_send(c, rsp, pos + size);
+        rsp = vid_get_blob(v, &v->uctls_blob, vid_build_uctls, &size);
+        if (!rsp)
+            break;
+        len = build_large_hdr(c, hdr, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, 
+                              id, size);
+        tcpc_send_hdr_ref(c, hdr, len, rsp, size, bufp_put, rsp);
 		break;
+    case REQUEST_ID(VID_GET_UCTL_LIST):
+        size = 0;
+        if (wc->req_len >= REQUEST_LEN(VID_GET_UCTL_LIST))
+            memcpy(&size, wc->req_dat, sizeof(__u32));
+        vid_send_uctl_list(v, c, id, size);
+        break;
+    case REQUEST_ID(VID_GET_UCTL_MULTI):
+        if (wc->req_len == 0 || wc->req_len % sizeof(__u32)) {
+            status = ERR_PARAM;
+            break;
+        }
+        size = wc->req_len / sizeof(__u32) * sizeof(struct v4l2_uctl_val);
+        rsp = bufp_alloc(FRAME_HDR_MAX + size);
+        if (!rsp)
+            break;
+        vid_get_uctl_multi(v, wc->req_dat, wc->req_len / sizeof(__u32), 
+                           &rsp[FRAME_HDR_MAX]);
+        build_and_send_large_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, 
+                                 id, rsp, size);
+        break;
     case REQUEST_ID(VID_SET_UCTL):
-        vid_set_uctl(v, &req[DAT_POS]);
+        if (wc->req_len < REQUEST_LEN(VID_SET_UCTL)) {
+            status = ERR_PARAM;
+            break;
+        }
+        vid_set_uctl(v, wc->req_dat);
+        break;
+    case REQUEST_ID(VID_SET_UCTLS):
+        if (wc->req_len == 0 || wc->req_len % sizeof(struct v4l2_uctl_val)) {
+            status = ERR_PARAM;
+            break;
+        }
+        if (vid_set_uctls(v, wc->req_dat, 
+                          wc->req_len / sizeof(struct v4l2_uctl_val), &ack))
+            status = ERR_PARAM;
+        break;
+    case REQUEST_ID(VID_SET_UCTLS_ACK):
+        if (wc->req_len == 0 || wc->req_len % sizeof(struct v4l2_uctl_val)) {
+            status = ERR_PARAM;
+            break;
+        }
+        vid_set_uctls(v, wc->req_dat, 
+                      wc->req_len / sizeof(struct v4l2_uctl_val), &ack);
+        build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID,
+                           id, sizeof(ack), (__u8 *)&ack);
         break;
     case REQUEST_ID(VID_SET_UCS2DEF):
         v4l2_set_uctls2def(v->cam);
@@ -322,44 +1292,57 @@ int vid_cmd_proc(tcpc_t c)
                            id, 8, dat);
 		break;
 
-#if 0
     case REQUEST_ID(VID_GET_FMTS):
         /*   
          * 应答帧结构: 字节 / 字段名称
          * 1    | 2    | 4                          | 长度由4字节数据部分指定
          * 长度 | 命令 | 数据(格式分辨率列表大小)   | 格式分辨率列表
+         * 使用扩展帧时格式分辨率列表直接作为数据
          */
-        len = sizeof(__u32);
-        pos = FRAME_HDR_SZ + len;
-        size = vid_get_fmts(v, &rsp[pos]);
-        build_rsp(rsp, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, id, len, (__u8*)&size);
-        send_func(c, rsp, pos + size);
+        size = vid_get_fmts_size(v);
+        rsp = bufp_alloc(FRAME_HDR_MAX + size);
+        if (!rsp)
+            break;
+        vid_get_fmts(v, &rsp[FRAME_HDR_MAX]);
+        build_and_send_large_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, 
+                                 id, rsp, size);
         break;
     case REQUEST_ID(VID_SET_FMT):
-        vid_set_fmt(v, &req[DAT_POS]);
+        if (wc->req_len < REQUEST_LEN(VID_SET_FMT) || 
+            vid_set_fmt(v, wc, wc->req_dat))
+            status = ERR_PARAM;
+        break;
+    case REQUEST_ID(VID_SET_FPS):
+        if (wc->req_len < REQUEST_LEN(VID_SET_FPS)) {
+            status = ERR_PARAM;
+            break;
+        }
+        vid_set_fps(v, wc, wc->req_dat);
+        break;
+    case REQUEST_ID(VID_GET_FPS):
+        vid_get_fps(v, dat);
+        build_and_send_rsp(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID,
+                           id, sizeof(struct vid_fps), dat);
         break;
-#endif
 
     case REQUEST_ID(VID_REQ_FRAME):
-        /*   
-         * 应答帧结构: 字节 / 字段名称
-         * 1    | 2    | 4                  | 长度由4字节数据部分指定
-         * 长度 | 命令 | 数据(图像帧大小)   | 图像帧
-         */
-        len = sizeof(__u32);
-        pos = FRAME_HDR_SZ + len;
-
-        pthread_mutex_lock(&v->tran_frm_mutex);
-        if (v->tran_frm_index != wc->last_frm_index) {
-            size = vid_get_trans_frame(v, &rsp[pos]);
-            wc->last_frm_index = v->tran_frm_index; 
-        } else {
-            size = 0;
-        }
-        pthread_mutex_unlock(&v->tran_frm_mutex);
+        pthread_mutex_lock(&v->sub_mutex);
+        f = vid_get_tran_frm(v, wc->last_frm_index);
+        if (f)
+            vid_cli_sent_frm(wc, f);
+        pthread_mutex_unlock(&v->sub_mutex);
+        vid_send_frm(c, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, id, f);
+        break;
 
-        build_rsp(rsp, (TYPE_SRSP << TYPE_BIT_POS) | SUBS_VID, id, len, (__u8*)&size);
-        tcpc_send(c, rsp, pos + size);
+    case REQUEST_ID(VID_SUBSCRIBE):
+        if (wc->req_len < REQUEST_LEN(VID_SUBSCRIBE)) {
+            status = ERR_PARAM;
+            break;
+        }
+        vid_subscribe(v, wc, wc->req_dat[0], wc->req_dat[1]);
+        break;
+    case REQUEST_ID(VID_UNSUBSCRIBE):
+        vid_unsubscribe(v, wc);
         break;
 
     default: